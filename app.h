@@ -1,6 +1,7 @@
 #ifndef __APP_H__
 #define __APP_H__
 
+#include "jobs.h"
 #include "types.h"
 
 typedef struct App {
@@ -20,11 +21,16 @@ typedef struct App {
     float turntableSpeed;
     glm::vec3 lightDir;
     RenderMode renderMode;
+    RasterBackend rasterBackend;
+    bool deferredShading;
+    bool useLODs;
+    float lodPixelError; // how far a LOD may stray from the full mesh on screen
 
     Png diffuseTexture;
     Png specTexture;
     Png normalMapTexture;
     Png glowTexture;
+    TextureFilter textureFilter;
 
     float translateX;
     float translateY;
@@ -34,6 +40,7 @@ typedef struct App {
     double deltaTime;
 
     World* world;
+    JobPool* jobs;
 
     const char *appTitle;
 } App;
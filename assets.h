@@ -0,0 +1,274 @@
+#ifndef __ASSETS_H__
+#define __ASSETS_H__
+
+#include "image.h"
+#include "jobs.h"
+#include "resources.h"
+#include "scenegraph.h"
+#include "texture-cache.h"
+#include "thirdparty/lodepng/lodepng.h"
+#include "types.h"
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdio.h>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Meshes and textures are loaded on threads of their own, so the window is up right away
+// and importing a big model never holds up a frame. Requests come from the main thread,
+// which calls updateAssets once a frame to take in what has finished. Only then do meshes
+// go into the library and shapes into the world, nothing the renderer reads is written
+// from a loader thread. The same file asked for twice is loaded once.
+
+enum AssetKind { ASSET_MESH, ASSET_TEXTURE };
+enum AssetState { ASSET_QUEUED, ASSET_LOADING, ASSET_READY, ASSET_FAILED };
+
+typedef struct Asset {
+    AssetKind kind;
+    std::string path;
+    std::string name; // file name without directory and extension
+    std::atomic<int> state;
+    MeshResource *mesh;   // owned by the mesh library once ready
+    Png texture;          // owned by the loader
+    void *textureMapping; // texture cache the texels are mapped from, NULL when decoded
+    size_t textureMappingSize;
+} Asset;
+
+// A shape waiting for its mesh.
+typedef struct AssetPlacement {
+    Asset *asset;
+    u32 parent;
+    char const *name;
+    bool doubleSided;
+} AssetPlacement;
+
+typedef struct AssetLoader {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::deque<Asset *> queue;
+    std::vector<Asset *> loaded; // done on a worker, not taken in by updateAssets yet
+    bool quit;
+    JobPool parseJobs; // chunks of one OBJ parsed side by side, one file at a time
+
+    // main thread only
+    std::vector<Asset *> assets; // every request in the order it was made
+    std::unordered_map<std::string, Asset *> byPath;
+    std::vector<AssetPlacement> placements;
+    MeshLibrary *library;
+    u32 finishedCount;
+} AssetLoader;
+
+Png loadPNG(const char *filename) {
+    unsigned error;
+    unsigned char *buffer = 0;
+    unsigned width, height;
+
+    error = lodepng_decode32_file(&buffer, &width, &height, filename);
+    if (error)
+        printf("error %u: %s\n", error, lodepng_error_text(error));
+
+    Png texture = {.buffer = buffer, .width = width, .height = height, .levelCount = 1};
+    if (buffer) {
+        buildMipChain(&texture);
+    }
+    return texture;
+}
+
+inline std::string getAssetName(const std::string &path) {
+    size_t start = path.find_last_of("/\\");
+    start = start == std::string::npos ? 0 : start + 1;
+    size_t end = path.find_last_of('.');
+    return path.substr(start, end == std::string::npos || end < start ? std::string::npos
+                                                                       : end - start);
+}
+
+inline bool loadAsset(Asset *asset, JobPool *parseJobs) {
+    if (asset->kind == ASSET_MESH) {
+        asset->mesh = loadMeshResource(asset->path.c_str(), parseJobs);
+        return asset->mesh != NULL;
+    }
+    if (loadTextureCache(asset->path.c_str(), &asset->texture, &asset->textureMapping,
+                         &asset->textureMappingSize)) {
+        return true;
+    }
+    asset->texture = loadPNG(asset->path.c_str());
+    if (!asset->texture.buffer) {
+        return false;
+    }
+    saveTextureCache(asset->path.c_str(), asset->texture);
+    return true;
+}
+
+inline void assetWorkerLoop(AssetLoader *loader) {
+    std::unique_lock<std::mutex> lock(loader->mutex);
+    for (;;) {
+        loader->wake.wait(lock, [&] { return loader->quit || !loader->queue.empty(); });
+        if (loader->quit) {
+            return;
+        }
+        Asset *asset = loader->queue.front();
+        loader->queue.pop_front();
+        asset->state = ASSET_LOADING;
+
+        lock.unlock();
+        loadAsset(asset, &loader->parseJobs);
+        lock.lock();
+
+        loader->loaded.push_back(asset);
+    }
+}
+
+// threadCount files load at once, parseThreadCount threads split up the parse of an OBJ.
+void startAssetLoader(AssetLoader *loader, MeshLibrary *library, int threadCount,
+                      int parseThreadCount) {
+    loader->quit = false;
+    startJobPool(&loader->parseJobs, parseThreadCount);
+    loader->library = library;
+    loader->finishedCount = 0;
+    if (threadCount < 1) {
+        threadCount = 1;
+    }
+    for (int i = 0; i < threadCount; i++) {
+        loader->workers.push_back(std::thread(assetWorkerLoop, loader));
+    }
+}
+
+// Waits for the files being loaded right now, whatever is still queued is dropped. Frees
+// the textures, so nothing may point at them anymore.
+void stopAssetLoader(AssetLoader *loader) {
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->quit = true;
+    }
+    loader->wake.notify_all();
+    for (int i = 0; i < loader->workers.size(); i++) {
+        loader->workers[i].join();
+    }
+    loader->workers.clear();
+    stopJobPool(&loader->parseJobs);
+
+    for (int i = 0; i < loader->assets.size(); i++) {
+        Asset *asset = loader->assets[i];
+        if (asset->state != ASSET_READY) {
+            delete asset->mesh;
+        }
+        if (asset->textureMapping) {
+            munmap(asset->textureMapping, asset->textureMappingSize);
+        } else {
+            free(asset->texture.buffer);
+        }
+        delete asset;
+    }
+    loader->assets.clear();
+    loader->byPath.clear();
+    loader->placements.clear();
+    loader->queue.clear();
+    loader->loaded.clear();
+}
+
+Asset *requestAsset(AssetLoader *loader, AssetKind kind, const char *path) {
+    std::unordered_map<std::string, Asset *>::iterator found = loader->byPath.find(path);
+    if (found != loader->byPath.end()) {
+        return found->second;
+    }
+
+    Asset *asset = new Asset();
+    asset->kind = kind;
+    asset->path = path;
+    asset->name = getAssetName(asset->path);
+    asset->mesh = NULL;
+    asset->texture = {};
+    asset->textureMapping = NULL;
+    asset->textureMappingSize = 0;
+    loader->assets.push_back(asset);
+    loader->byPath[path] = asset;
+
+    // already in the library, from a loader that was stopped since
+    if (kind == ASSET_MESH && loader->library->resources.count(path)) {
+        asset->mesh = loader->library->resources[path];
+        asset->state = ASSET_READY;
+        loader->finishedCount++;
+        return asset;
+    }
+
+    asset->state = ASSET_QUEUED;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loader->queue.push_back(asset);
+    }
+    loader->wake.notify_one();
+    return asset;
+}
+
+inline Asset *requestMesh(AssetLoader *loader, const char *path) {
+    return requestAsset(loader, ASSET_MESH, path);
+}
+
+inline Asset *requestTexture(AssetLoader *loader, const char *path) {
+    return requestAsset(loader, ASSET_TEXTURE, path);
+}
+
+// Adds a shape of the mesh at path under parent as soon as the mesh is in. Shapes of a
+// mesh that fails to load are never added. name has to outlive the world, pass NULL to
+// use the asset's name.
+Asset *placeMesh(AssetLoader *loader, u32 parent, const char *path, const char *name,
+                 bool doubleSided) {
+    Asset *asset = requestMesh(loader, path);
+    AssetPlacement placement = {.asset = asset,
+                                .parent = parent,
+                                .name = name ? name : asset->name.c_str(),
+                                .doubleSided = doubleSided};
+    loader->placements.push_back(placement);
+    return asset;
+}
+
+inline bool isAssetFinished(Asset *asset) {
+    return asset->state == ASSET_READY || asset->state == ASSET_FAILED;
+}
+
+// Takes in the loads that finished since the last call and places the shapes waiting on
+// them. Main thread, between frames.
+void updateAssets(AssetLoader *loader, World *world) {
+    std::vector<Asset *> loaded;
+    {
+        std::lock_guard<std::mutex> lock(loader->mutex);
+        loaded.swap(loader->loaded);
+    }
+
+    for (int i = 0; i < loaded.size(); i++) {
+        Asset *asset = loaded[i];
+        bool ready = asset->kind == ASSET_MESH ? asset->mesh != NULL
+                                               : asset->texture.buffer != NULL;
+        if (ready && asset->kind == ASSET_MESH) {
+            loader->library->resources[asset->path] = asset->mesh;
+        }
+        if (!ready) {
+            printf("Can't load %s\n", asset->path.c_str());
+        }
+        asset->state = ready ? ASSET_READY : ASSET_FAILED;
+        loader->finishedCount++;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < loader->placements.size(); i++) {
+        AssetPlacement &placement = loader->placements[i];
+        if (placement.asset->state == ASSET_READY) {
+            addShape(world, placement.parent, placement.name, placement.asset->mesh,
+                     placement.doubleSided);
+        } else if (placement.asset->state != ASSET_FAILED) {
+            loader->placements[kept++] = placement;
+        }
+    }
+    loader->placements.resize(kept);
+}
+
+inline u32 getPendingAssetCount(AssetLoader *loader) {
+    return loader->assets.size() - loader->finishedCount;
+}
+
+#endif // __ASSETS_H__
@@ -0,0 +1,370 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include "types.h"
+#include <algorithm>
+#include <float.h>
+#include <glm/gtx/transform.hpp>
+#include <vector>
+
+// Triangle BVH for ray and box queries against a mesh, in the mesh's object space.
+//
+// Built top down with the surface area heuristic over BVH_BIN_COUNT bins of triangle
+// centroids per axis. Nodes are 32 bytes and siblings are stored next to each other, so
+// both children of a node come in with one cache line. The triangle corners are copied
+// in leaf order, a leaf reads one contiguous run of them.
+
+#define BVH_BIN_COUNT 16
+#define BVH_MAX_DEPTH 64
+#define BVH_NODE_COST 1.0f // cost of visiting a node, relative to one triangle test
+
+typedef struct Ray {
+    glm::vec3 origin;
+    glm::vec3 direction; // doesn't need to be normalized, t is in units of it
+    float tMax;
+} Ray;
+
+typedef struct RayHit {
+    float t;
+    u32 triangle; // into the mesh
+    float u;      // barycentric weight of corner 1
+    float v;      // barycentric weight of corner 2
+} RayHit;
+
+// Half the surface area of the box, only ever compared with others.
+inline float getBoxArea(glm::vec3 min, glm::vec3 max) {
+    glm::vec3 d = max - min;
+    return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+typedef struct BVHBin {
+    glm::vec3 min;
+    glm::vec3 max;
+    u32 count;
+} BVHBin;
+
+typedef struct BVHBuilder {
+    std::vector<glm::vec3> centroids;
+    std::vector<glm::vec3> triangleMin;
+    std::vector<glm::vec3> triangleMax;
+} BVHBuilder;
+
+void updateNodeBounds(BVH &bvh, BVHBuilder &builder, u32 nodeIndex) {
+    BVHNode &node = bvh.nodes[nodeIndex];
+    node.min = glm::vec3(FLT_MAX);
+    node.max = glm::vec3(-FLT_MAX);
+    for (u32 i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        node.min = glm::min(node.min, builder.triangleMin[bvh.triangles[i]]);
+        node.max = glm::max(node.max, builder.triangleMax[bvh.triangles[i]]);
+    }
+}
+
+// Cheapest binned split of the node, returns its SAH cost or FLT_MAX when the centroids
+// can't be separated.
+float findBestSplit(BVH &bvh, BVHBuilder &builder, BVHNode &node, int *bestAxis,
+                    float *bestPosition) {
+    glm::vec3 centroidMin(FLT_MAX);
+    glm::vec3 centroidMax(-FLT_MAX);
+    for (u32 i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+        centroidMin = glm::min(centroidMin, builder.centroids[bvh.triangles[i]]);
+        centroidMax = glm::max(centroidMax, builder.centroids[bvh.triangles[i]]);
+    }
+
+    float bestCost = FLT_MAX;
+    for (int axis = 0; axis < 3; axis++) {
+        float extent = centroidMax[axis] - centroidMin[axis];
+        if (extent <= 0) {
+            continue;
+        }
+
+        BVHBin bins[BVH_BIN_COUNT];
+        for (int b = 0; b < BVH_BIN_COUNT; b++) {
+            bins[b].min = glm::vec3(FLT_MAX);
+            bins[b].max = glm::vec3(-FLT_MAX);
+            bins[b].count = 0;
+        }
+        float scale = BVH_BIN_COUNT / extent;
+        for (u32 i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+            u32 t = bvh.triangles[i];
+            int b = std::min(BVH_BIN_COUNT - 1,
+                             int((builder.centroids[t][axis] - centroidMin[axis]) * scale));
+            bins[b].min = glm::min(bins[b].min, builder.triangleMin[t]);
+            bins[b].max = glm::max(bins[b].max, builder.triangleMax[t]);
+            bins[b].count++;
+        }
+
+        // sweep from both sides, split s puts bins 0..s-1 on the left
+        float leftArea[BVH_BIN_COUNT];
+        u32 leftCount[BVH_BIN_COUNT];
+        glm::vec3 min(FLT_MAX), max(-FLT_MAX);
+        u32 count = 0;
+        for (int b = 0; b < BVH_BIN_COUNT - 1; b++) {
+            min = glm::min(min, bins[b].min);
+            max = glm::max(max, bins[b].max);
+            count += bins[b].count;
+            leftArea[b + 1] = count ? getBoxArea(min, max) : 0;
+            leftCount[b + 1] = count;
+        }
+        min = glm::vec3(FLT_MAX);
+        max = glm::vec3(-FLT_MAX);
+        count = 0;
+        for (int b = BVH_BIN_COUNT - 1; b > 0; b--) {
+            min = glm::min(min, bins[b].min);
+            max = glm::max(max, bins[b].max);
+            count += bins[b].count;
+            float rightArea = count ? getBoxArea(min, max) : 0;
+            float cost = leftCount[b] * leftArea[b] + count * rightArea;
+            if (cost < bestCost) {
+                bestCost = cost;
+                *bestAxis = axis;
+                *bestPosition = centroidMin[axis] + b / scale;
+            }
+        }
+    }
+    return bestCost;
+}
+
+void buildBVH(Mesh &mesh, BVH &bvh) {
+    u32 triangleCount = getMeshTriangleCount(mesh);
+    bvh.nodes.clear();
+    bvh.triangles.resize(triangleCount);
+    bvh.corners.clear();
+    if (!triangleCount) {
+        return;
+    }
+
+    BVHBuilder builder;
+    builder.centroids.resize(triangleCount);
+    builder.triangleMin.resize(triangleCount);
+    builder.triangleMax.resize(triangleCount);
+    for (u32 t = 0; t < triangleCount; t++) {
+        glm::vec3 p0 = getMeshPosition(mesh, mesh.indices[t * 3]);
+        glm::vec3 p1 = getMeshPosition(mesh, mesh.indices[t * 3 + 1]);
+        glm::vec3 p2 = getMeshPosition(mesh, mesh.indices[t * 3 + 2]);
+        builder.triangleMin[t] = glm::min(glm::min(p0, p1), p2);
+        builder.triangleMax[t] = glm::max(glm::max(p0, p1), p2);
+        builder.centroids[t] = (p0 + p1 + p2) * (1.0f / 3.0f);
+        bvh.triangles[t] = t;
+    }
+
+    bvh.nodes.reserve(triangleCount * 2);
+    BVHNode root = {};
+    root.leftFirst = 0;
+    root.count = triangleCount;
+    bvh.nodes.push_back(root);
+    updateNodeBounds(bvh, builder, 0);
+
+    // nodes still to split, with their depth
+    std::vector<std::pair<u32, int>> stack;
+    stack.push_back(std::make_pair(0u, 1));
+    while (!stack.empty()) {
+        u32 nodeIndex = stack.back().first;
+        int depth = stack.back().second;
+        stack.pop_back();
+
+        BVHNode node = bvh.nodes[nodeIndex];
+        if (node.count <= 1 || depth >= BVH_MAX_DEPTH) {
+            continue;
+        }
+
+        int axis = 0;
+        float position = 0;
+        float splitCost = findBestSplit(bvh, builder, node, &axis, &position);
+        float leafCost = node.count * getBoxArea(node.min, node.max);
+        if (splitCost == FLT_MAX ||
+            BVH_NODE_COST * getBoxArea(node.min, node.max) + splitCost >= leafCost) {
+            continue;
+        }
+
+        u32 *first = &bvh.triangles[node.leftFirst];
+        u32 *middle = std::partition(first, first + node.count, [&](u32 t) {
+            return builder.centroids[t][axis] < position;
+        });
+        u32 leftCount = middle - first;
+        if (leftCount == 0 || leftCount == node.count) {
+            continue;
+        }
+
+        u32 left = bvh.nodes.size();
+        BVHNode child = {};
+        child.leftFirst = node.leftFirst;
+        child.count = leftCount;
+        bvh.nodes.push_back(child);
+        child.leftFirst = node.leftFirst + leftCount;
+        child.count = node.count - leftCount;
+        bvh.nodes.push_back(child);
+        updateNodeBounds(bvh, builder, left);
+        updateNodeBounds(bvh, builder, left + 1);
+
+        bvh.nodes[nodeIndex].leftFirst = left;
+        bvh.nodes[nodeIndex].count = 0;
+        stack.push_back(std::make_pair(left, depth + 1));
+        stack.push_back(std::make_pair(left + 1, depth + 1));
+    }
+
+    bvh.corners.resize(triangleCount * 3);
+    for (u32 i = 0; i < triangleCount; i++) {
+        for (int k = 0; k < 3; k++) {
+            u32 vertex = mesh.indices[bvh.triangles[i] * 3 + k];
+            bvh.corners[i * 3 + k] = getMeshPosition(mesh, vertex);
+        }
+    }
+}
+
+// Distance along the ray to where it enters the box, FLT_MAX when it misses or enters
+// past tMax.
+inline float intersectBox(glm::vec3 min, glm::vec3 max, glm::vec3 origin,
+                          glm::vec3 inverseDirection, float tMax) {
+    glm::vec3 t0 = (min - origin) * inverseDirection;
+    glm::vec3 t1 = (max - origin) * inverseDirection;
+    glm::vec3 tEnter = glm::min(t0, t1);
+    glm::vec3 tExit = glm::max(t0, t1);
+    float enter = std::max(std::max(tEnter.x, tEnter.y), tEnter.z);
+    float exit = std::min(std::min(tExit.x, tExit.y), tExit.z);
+    if (exit < enter || exit < 0 || enter >= tMax) {
+        return FLT_MAX;
+    }
+    return enter;
+}
+
+// Moller-Trumbore, both sides of the triangle count.
+inline bool intersectTriangle(Ray &ray, glm::vec3 *corners, float tMax, float *t, float *u,
+                              float *v) {
+    glm::vec3 edge1 = corners[1] - corners[0];
+    glm::vec3 edge2 = corners[2] - corners[0];
+    glm::vec3 p = glm::cross(ray.direction, edge2);
+    float det = glm::dot(edge1, p);
+    if (det == 0) {
+        return false;
+    }
+
+    float invDet = 1.0f / det;
+    glm::vec3 s = ray.origin - corners[0];
+    *u = glm::dot(s, p) * invDet;
+    if (*u < 0 || *u > 1) {
+        return false;
+    }
+    glm::vec3 q = glm::cross(s, edge1);
+    *v = glm::dot(ray.direction, q) * invDet;
+    if (*v < 0 || *u + *v > 1) {
+        return false;
+    }
+    *t = glm::dot(edge2, q) * invDet;
+    return *t > 0 && *t < tMax;
+}
+
+// Walks the tree for a ray, nearer child first. With anyHit it stops at the first
+// triangle hit, otherwise hit ends up with the closest one.
+bool traverseBVH(BVH &bvh, Ray &ray, bool anyHit, RayHit *hit) {
+    if (bvh.nodes.empty()) {
+        return false;
+    }
+
+    glm::vec3 inverseDirection = 1.0f / ray.direction;
+    float tMax = ray.tMax;
+    bool found = false;
+
+    BVHNode *nodes = bvh.nodes.data();
+    if (intersectBox(nodes[0].min, nodes[0].max, ray.origin, inverseDirection, tMax) ==
+        FLT_MAX) {
+        return false;
+    }
+
+    u32 stack[BVH_MAX_DEPTH];
+    int stackSize = 0;
+    u32 nodeIndex = 0;
+    for (;;) {
+        BVHNode &node = nodes[nodeIndex];
+        if (node.count) {
+            for (u32 i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+                float t, u, v;
+                if (intersectTriangle(ray, &bvh.corners[i * 3], tMax, &t, &u, &v)) {
+                    tMax = t;
+                    found = true;
+                    hit->t = t;
+                    hit->triangle = bvh.triangles[i];
+                    hit->u = u;
+                    hit->v = v;
+                    if (anyHit) {
+                        return true;
+                    }
+                }
+            }
+        } else {
+            u32 nearChild = node.leftFirst;
+            u32 farChild = node.leftFirst + 1;
+            float tNear = intersectBox(nodes[nearChild].min, nodes[nearChild].max, ray.origin,
+                                       inverseDirection, tMax);
+            float tFar = intersectBox(nodes[farChild].min, nodes[farChild].max, ray.origin,
+                                      inverseDirection, tMax);
+            if (tFar < tNear) {
+                std::swap(nearChild, farChild);
+                std::swap(tNear, tFar);
+            }
+            if (tNear != FLT_MAX) {
+                if (tFar != FLT_MAX) {
+                    stack[stackSize++] = farChild;
+                }
+                nodeIndex = nearChild;
+                continue;
+            }
+        }
+
+        // next pushed node the ray still reaches before the closest hit so far
+        for (;;) {
+            if (!stackSize) {
+                return found;
+            }
+            nodeIndex = stack[--stackSize];
+            if (intersectBox(nodes[nodeIndex].min, nodes[nodeIndex].max, ray.origin,
+                             inverseDirection, tMax) != FLT_MAX) {
+                break;
+            }
+        }
+    }
+}
+
+// Closest triangle along the ray before ray.tMax.
+inline bool intersectBVH(BVH &bvh, Ray ray, RayHit *hit) {
+    return traverseBVH(bvh, ray, false, hit);
+}
+
+// Whether anything is hit before ray.tMax, for shadow and occlusion rays.
+inline bool isOccluded(BVH &bvh, Ray ray) {
+    RayHit hit;
+    return traverseBVH(bvh, ray, true, &hit);
+}
+
+// Appends every triangle whose bounding box overlaps the box.
+void queryBVHBox(BVH &bvh, glm::vec3 min, glm::vec3 max, std::vector<u32> &out) {
+    if (bvh.nodes.empty()) {
+        return;
+    }
+
+    u32 stack[BVH_MAX_DEPTH * 2];
+    int stackSize = 0;
+    stack[stackSize++] = 0;
+    while (stackSize) {
+        BVHNode &node = bvh.nodes[stack[--stackSize]];
+        if (glm::any(glm::lessThan(node.max, min)) ||
+            glm::any(glm::greaterThan(node.min, max))) {
+            continue;
+        }
+        if (!node.count) {
+            stack[stackSize++] = node.leftFirst;
+            stack[stackSize++] = node.leftFirst + 1;
+            continue;
+        }
+        for (u32 i = node.leftFirst; i < node.leftFirst + node.count; i++) {
+            glm::vec3 *corners = &bvh.corners[i * 3];
+            glm::vec3 triangleMin = glm::min(glm::min(corners[0], corners[1]), corners[2]);
+            glm::vec3 triangleMax = glm::max(glm::max(corners[0], corners[1]), corners[2]);
+            if (!glm::any(glm::lessThan(triangleMax, min)) &&
+                !glm::any(glm::greaterThan(triangleMin, max))) {
+                out.push_back(bvh.triangles[i]);
+            }
+        }
+    }
+}
+
+#endif // __BVH_H__
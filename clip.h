@@ -0,0 +1,170 @@
+#ifndef __CLIP_H__
+#define __CLIP_H__
+
+#include "types.h"
+#include <glm/gtx/transform.hpp>
+
+// Triangle clipping in homogeneous clip space.
+//
+// Our view matrix is right handed (camera looks down -z) while the projection is
+// perspectiveLH, so everything in front of the camera ends up with a negative w. The
+// plane distances below work on -w for that reason.
+//
+// Only the near plane is always clipped against. Sideways the rasterizer clamps to the
+// viewport anyway, so triangles are just kept inside a guard band a few screens wide,
+// which keeps the edge functions well conditioned without clipping every triangle that
+// pokes out of the screen.
+
+#define GUARD_BAND 2.0f // in NDC units, 1 is the viewport edge
+
+#define CLIP_NEAR 1
+#define CLIP_LEFT 2
+#define CLIP_RIGHT 4
+#define CLIP_BOTTOM 8
+#define CLIP_TOP 16
+#define CLIP_PLANE_COUNT 5
+
+// every plane can add one vertex to the polygon
+#define CLIP_MAX_VERTICES (3 + CLIP_PLANE_COUNT)
+
+typedef struct ClipVertex {
+    glm::vec4 position;
+    glm::vec3 barycentric; // relative to the unclipped triangle
+} ClipVertex;
+
+inline float getClipDistance(glm::vec4 p, u32 plane, float zNear) {
+    float w = -p.w;
+    switch (plane) {
+    case CLIP_NEAR:
+        return w - zNear;
+    case CLIP_LEFT:
+        return GUARD_BAND * w + p.x;
+    case CLIP_RIGHT:
+        return GUARD_BAND * w - p.x;
+    case CLIP_BOTTOM:
+        return GUARD_BAND * w + p.y;
+    case CLIP_TOP:
+        return GUARD_BAND * w - p.y;
+    }
+    return 0;
+}
+
+// Bit set for every plane the point is outside of.
+inline u32 getClipCode(glm::vec4 p, float zNear) {
+    u32 code = 0;
+    for (u32 plane = 1; plane < (1 << CLIP_PLANE_COUNT); plane <<= 1) {
+        if (getClipDistance(p, plane, zNear) < 0) {
+            code |= plane;
+        }
+    }
+    return code;
+}
+
+// Sutherland-Hodgman against a single plane, returns the new vertex count.
+int clipPolygon(ClipVertex *vertices, int count, u32 plane, float zNear, ClipVertex *out) {
+    int outCount = 0;
+    for (int i = 0; i < count; i++) {
+        ClipVertex &a = vertices[i];
+        ClipVertex &b = vertices[(i + 1) % count];
+        float da = getClipDistance(a.position, plane, zNear);
+        float db = getClipDistance(b.position, plane, zNear);
+
+        if (da >= 0) {
+            out[outCount++] = a;
+        }
+
+        if ((da >= 0) != (db >= 0)) {
+            float t = da / (da - db);
+            ClipVertex v;
+            v.position = a.position + (b.position - a.position) * t;
+            v.barycentric = a.barycentric + (b.barycentric - a.barycentric) * t;
+            out[outCount++] = v;
+        }
+    }
+    return outCount;
+}
+
+// Clips against the planes in the mask and returns the polygon as a triangle fan,
+// out needs room for CLIP_MAX_VERTICES.
+int clipTriangle(glm::vec4 *positions, u32 planes, float zNear, ClipVertex *out) {
+    ClipVertex scratch[CLIP_MAX_VERTICES];
+
+    out[0].position = positions[0];
+    out[0].barycentric = glm::vec3(1, 0, 0);
+    out[1].position = positions[1];
+    out[1].barycentric = glm::vec3(0, 1, 0);
+    out[2].position = positions[2];
+    out[2].barycentric = glm::vec3(0, 0, 1);
+
+    int count = 3;
+    for (u32 plane = 1; plane < (1 << CLIP_PLANE_COUNT) && count >= 3; plane <<= 1) {
+        if (!(planes & plane)) {
+            continue;
+        }
+        count = clipPolygon(out, count, plane, zNear, scratch);
+        for (int i = 0; i < count; i++) {
+            out[i] = scratch[i];
+        }
+    }
+
+    return count < 3 ? 0 : count;
+}
+
+// Same math as glm::project, split out so clipping can happen in between.
+inline glm::vec3 clipToViewport(glm::vec4 p, glm::vec4 viewport) {
+    p /= p.w;
+    p = p * 0.5f + 0.5f;
+    p[0] = p[0] * viewport[2] + viewport[0];
+    p[1] = p[1] * viewport[3] + viewport[1];
+    return glm::vec3(p);
+}
+
+// Frustum planes taken straight from the rows of the clip matrix, a point is inside
+// when dot(plane, vec4(p, 1)) >= 0. Same -w convention as above, no far plane.
+inline void getFrustumPlanes(glm::mat4 clipMatrix, float zNear, glm::vec4 *planes) {
+    glm::vec4 rows[4];
+    for (int i = 0; i < 4; i++) {
+        rows[i] = glm::vec4(clipMatrix[0][i], clipMatrix[1][i], clipMatrix[2][i],
+                            clipMatrix[3][i]);
+    }
+    planes[0] = -rows[3] - glm::vec4(0, 0, 0, zNear);
+    planes[1] = -rows[3] + rows[0];
+    planes[2] = -rows[3] - rows[0];
+    planes[3] = -rows[3] + rows[1];
+    planes[4] = -rows[3] - rows[1];
+}
+
+inline bool isSphereOutsideFrustum(glm::vec4 *planes, glm::vec3 center, float radius) {
+    for (int i = 0; i < CLIP_PLANE_COUNT; i++) {
+        glm::vec3 normal = glm::vec3(planes[i]);
+        if (glm::dot(normal, center) + planes[i].w < -radius * glm::length(normal)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// True when the bounds are completely outside one of the frustum planes. The sphere is
+// checked first, the box only when the sphere straddles a plane.
+inline bool isOutsideFrustum(Bounds &bounds, glm::mat4 clipMatrix, float zNear) {
+    glm::vec4 planes[CLIP_PLANE_COUNT];
+    getFrustumPlanes(clipMatrix, zNear, planes);
+
+    if (isSphereOutsideFrustum(planes, bounds.center, bounds.radius)) {
+        return true;
+    }
+
+    for (int i = 0; i < CLIP_PLANE_COUNT; i++) {
+        // corner of the box furthest along the plane normal
+        glm::vec3 normal = glm::vec3(planes[i]);
+        glm::vec3 corner = glm::vec3(normal.x > 0 ? bounds.max.x : bounds.min.x,
+                                     normal.y > 0 ? bounds.max.y : bounds.min.y,
+                                     normal.z > 0 ? bounds.max.z : bounds.min.z);
+        if (glm::dot(normal, corner) + planes[i].w < 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+#endif // __CLIP_H__
@@ -102,26 +102,172 @@ glm::vec3 toBarycentric(glm::vec3 bc, glm::vec3 *v) {
     return bc[0] * v[0] + bc[1] * v[1] + bc[2] * v[2];
 }
 
-glm::vec3 sampleNormalTexture(int offset, Png texture) {
-    unsigned char r = texture.buffer[offset];
-    unsigned char g = texture.buffer[offset + 1];
-    unsigned char b = texture.buffer[offset + 2];
+// Mip levels halve the size of the one before, rounding down, until 1x1.
+inline u32 getMipLevelCount(u32 width, u32 height) {
+    u32 levelCount = 1;
+    while (width > 1 || height > 1) {
+        width = glm::max(width / 2, 1u);
+        height = glm::max(height / 2, 1u);
+        levelCount++;
+    }
+    return levelCount;
+}
+
+// Bytes from the start of the buffer to the given level, or the whole chain when level
+// is the level count.
+inline size_t getMipLevelOffset(u32 width, u32 height, u32 level) {
+    size_t offset = 0;
+    for (u32 i = 0; i < level; i++) {
+        offset += size_t(width) * height * 4;
+        width = glm::max(width / 2, 1u);
+        height = glm::max(height / 2, 1u);
+    }
+    return offset;
+}
+
+// Grows the malloc'd level 0 in texture into the full chain, every texel of a level
+// the average of the 2x2 it covers in the one above.
+void buildMipChain(Png *texture) {
+    texture->levelCount = getMipLevelCount(texture->width, texture->height);
+    size_t size = getMipLevelOffset(texture->width, texture->height, texture->levelCount);
+    texture->buffer = (unsigned char *)realloc(texture->buffer, size);
 
-    float fr = r / 255.0f;
-    float fg = g / 255.0f;
-    float fb = b / 255.0f;
+    u32 width = texture->width;
+    u32 height = texture->height;
+    unsigned char *source = texture->buffer;
+    for (u32 level = 1; level < texture->levelCount; level++) {
+        u32 levelWidth = glm::max(width / 2, 1u);
+        u32 levelHeight = glm::max(height / 2, 1u);
+        unsigned char *target = source + size_t(width) * height * 4;
+        for (u32 y = 0; y < levelHeight; y++) {
+            unsigned char *row0 = source + size_t(y * 2) * width * 4;
+            unsigned char *row1 = source + size_t(glm::min(y * 2 + 1, height - 1)) * width * 4;
+            for (u32 x = 0; x < levelWidth; x++) {
+                u32 x0 = x * 2 * 4;
+                u32 x1 = glm::min(x * 2 + 1, width - 1) * 4;
+                for (int c = 0; c < 4; c++) {
+                    u32 sum = row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c];
+                    target[(y * levelWidth + x) * 4 + c] = (sum + 2) / 4;
+                }
+            }
+        }
+        source = target;
+        width = levelWidth;
+        height = levelHeight;
+    }
+}
 
-    glm::vec3 textureNormal = glm::vec3(2.0f * fr - 1.0f, 2.0f * fg - 1.0f, 2.0f * fb - 1.0f);
+// A filtered read at uv, not tied to a texture yet. ddx and ddy are how far uv moves
+// between neighbouring pixels, the level is picked once the size of a map is known. Maps
+// of different sizes are read with the same sample.
+typedef struct TextureSample {
+    glm::vec2 uv;
+    glm::vec2 ddx;
+    glm::vec2 ddy;
+    TextureFilter filter;
+} TextureSample;
 
-    return textureNormal;
+// Texels a sample reads in a texture of width x height and how much each of them counts.
+// The maps of a material mostly share a size, so one lookup serves all of those.
+typedef struct TextureLookup {
+    u32 offsets[8];
+    float weights[8];
+    int count;
+    u32 width; // of level 0, 0 before the first map is read
+    u32 height;
+} TextureLookup;
+
+inline void addNearestTexel(TextureLookup &lookup, u32 levelOffset, u32 width, u32 height,
+                            glm::vec2 uv) {
+    int x = glm::clamp(int(uv.x * width), 0, int(width) - 1);
+    int y = glm::clamp(int(uv.y * height), 0, int(height) - 1);
+    lookup.offsets[lookup.count] = levelOffset + (y * width + x) * 4;
+    lookup.weights[lookup.count] = 1;
+    lookup.count++;
 }
 
-glm::vec3 sampleTexture(int offset, Png texture) {
-    unsigned char r = texture.buffer[offset];
-    unsigned char g = texture.buffer[offset + 1];
-    unsigned char b = texture.buffer[offset + 2];
+inline void addBilinearTexels(TextureLookup &lookup, u32 levelOffset, u32 width, u32 height,
+                              glm::vec2 uv, float weight) {
+    // texel centers sit at half texels, edges are clamped
+    float s = uv.x * width - 0.5f;
+    float t = uv.y * height - 0.5f;
+    float floorS = floorf(s);
+    float floorT = floorf(t);
+    float fractionS = s - floorS;
+    float fractionT = t - floorT;
+    int x0 = glm::clamp(int(floorS), 0, int(width) - 1);
+    int y0 = glm::clamp(int(floorT), 0, int(height) - 1);
+    int x1 = glm::clamp(int(floorS) + 1, 0, int(width) - 1);
+    int y1 = glm::clamp(int(floorT) + 1, 0, int(height) - 1);
+
+    u32 *offsets = &lookup.offsets[lookup.count];
+    float *weights = &lookup.weights[lookup.count];
+    offsets[0] = levelOffset + (y0 * width + x0) * 4;
+    offsets[1] = levelOffset + (y0 * width + x1) * 4;
+    offsets[2] = levelOffset + (y1 * width + x0) * 4;
+    offsets[3] = levelOffset + (y1 * width + x1) * 4;
+    weights[0] = (1 - fractionS) * (1 - fractionT) * weight;
+    weights[1] = fractionS * (1 - fractionT) * weight;
+    weights[2] = (1 - fractionS) * fractionT * weight;
+    weights[3] = fractionS * fractionT * weight;
+    lookup.count += 4;
+}
+
+// Picks the mip level from how far uv moves between neighbouring pixels, measured in
+// texels of level 0. Bilinear reads the nearest level, trilinear blends the two around
+// it. Nearest reads level 0 unfiltered.
+inline TextureLookup getTextureLookup(Png texture, TextureSample &sample) {
+    TextureLookup lookup;
+    lookup.count = 0;
+    lookup.width = texture.width;
+    lookup.height = texture.height;
+    if (sample.filter == TEXTURE_NEAREST) {
+        addNearestTexel(lookup, 0, texture.width, texture.height, sample.uv);
+        return lookup;
+    }
+
+    glm::vec2 size(texture.width, texture.height);
+    glm::vec2 ddx = sample.ddx * size;
+    glm::vec2 ddy = sample.ddy * size;
+    float rho2 = glm::max(glm::dot(ddx, ddx), glm::dot(ddy, ddy));
+    float maxLevel = texture.levelCount - 1;
+    float lod = 0.5f * log2f(rho2);
+    lod = lod > 0 ? fminf(lod, maxLevel) : 0; // NaN from a degenerate quad ends up at 0
+
+    u32 level = sample.filter == TEXTURE_BILINEAR ? u32(lod + 0.5f) : u32(lod);
+    float blend = sample.filter == TEXTURE_BILINEAR ? 0 : lod - level;
+
+    u32 width = glm::max(texture.width >> level, 1u);
+    u32 height = glm::max(texture.height >> level, 1u);
+    u32 offset = getMipLevelOffset(texture.width, texture.height, level);
+    addBilinearTexels(lookup, offset, width, height, sample.uv, 1 - blend);
+    if (blend > 0) {
+        offset += width * height * 4;
+        width = glm::max(width / 2, 1u);
+        height = glm::max(height / 2, 1u);
+        addBilinearTexels(lookup, offset, width, height, sample.uv, blend);
+    }
+    return lookup;
+}
+
+// lookup is what the previous map read with sample used, it is only worked out again
+// when texture has another size.
+inline glm::vec3 sampleTexture(TextureSample &sample, TextureLookup &lookup, Png texture) {
+    if (lookup.width != texture.width || lookup.height != texture.height) {
+        lookup = getTextureLookup(texture, sample);
+    }
+    glm::vec3 color(0);
+    for (int i = 0; i < lookup.count; i++) {
+        unsigned char *texel = texture.buffer + lookup.offsets[i];
+        color += glm::vec3(texel[0], texel[1], texel[2]) * lookup.weights[i];
+    }
+    return color;
+}
 
-    return glm::vec3(r, g, b);
+inline glm::vec3 sampleNormalTexture(TextureSample &sample, TextureLookup &lookup,
+                                     Png texture) {
+    glm::vec3 textureNormal = sampleTexture(sample, lookup, texture) / 255.0f;
+    return textureNormal * 2.0f - 1.0f;
 }
 
 #endif // __IMAGE_H_
@@ -0,0 +1,135 @@
+#ifndef __JOBS_H__
+#define __JOBS_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "types.h"
+
+// A job is an index into whatever the caller passed as userdata. All jobs of a
+// batch run through the same callback, so no allocation is needed per job.
+typedef void (*JobCallback)(void *userdata, int jobIndex);
+
+typedef struct JobPool {
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+
+    JobCallback callback;
+    void *userdata;
+    int jobCount;
+    std::atomic<int> nextJob;
+
+    // Workers currently inside a batch. A new batch is only set up once this is zero
+    // again, so nobody can pair a job index of one batch with the callback of the next.
+    int busyWorkers;
+    u64 batch;
+    // Set while a caller is inside runJobs. Callers on other threads wait for it to clear,
+    // so a batch never loses the jobs it hasn't handed out yet to the next one.
+    bool running;
+    bool quit;
+} JobPool;
+
+inline void drainJobs(JobPool *pool) {
+    for (;;) {
+        int job = pool->nextJob.fetch_add(1);
+        if (job >= pool->jobCount) {
+            break;
+        }
+        pool->callback(pool->userdata, job);
+    }
+}
+
+inline void jobWorkerLoop(JobPool *pool) {
+    u64 seenBatch = 0;
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    for (;;) {
+        pool->wake.wait(lock, [&] { return pool->quit || pool->batch != seenBatch; });
+        if (pool->quit) {
+            return;
+        }
+        seenBatch = pool->batch;
+        pool->busyWorkers++;
+
+        lock.unlock();
+        drainJobs(pool);
+        lock.lock();
+
+        pool->busyWorkers--;
+        if (!pool->busyWorkers) {
+            pool->finished.notify_all();
+        }
+    }
+}
+
+// threadCount includes the calling thread, which always works on its own batches.
+inline void startJobPool(JobPool *pool, int threadCount) {
+    pool->callback = NULL;
+    pool->userdata = NULL;
+    pool->jobCount = 0;
+    pool->nextJob = 0;
+    pool->busyWorkers = 0;
+    pool->batch = 0;
+    pool->running = false;
+    pool->quit = false;
+
+    for (int i = 1; i < threadCount; i++) {
+        pool->workers.push_back(std::thread(jobWorkerLoop, pool));
+    }
+}
+
+inline void stopJobPool(JobPool *pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+        pool->quit = true;
+    }
+    pool->wake.notify_all();
+    for (int i = 0; i < pool->workers.size(); i++) {
+        pool->workers[i].join();
+    }
+    pool->workers.clear();
+}
+
+inline int jobThreadCount(JobPool *pool) { return pool ? pool->workers.size() + 1 : 1; }
+
+// Runs callback(userdata, 0..count-1) across the pool and returns once every job has
+// finished. Without a pool the jobs simply run on the calling thread. Batches run one at
+// a time, callers on different threads take turns.
+inline void runJobs(JobPool *pool, JobCallback callback, void *userdata, int count) {
+    if (count <= 0) {
+        return;
+    }
+
+    if (!pool || pool->workers.empty() || count == 1) {
+        for (int i = 0; i < count; i++) {
+            callback(userdata, i);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(pool->mutex);
+    pool->finished.wait(lock, [&] { return !pool->running && pool->busyWorkers == 0; });
+    pool->running = true;
+    pool->callback = callback;
+    pool->userdata = userdata;
+    pool->jobCount = count;
+    pool->nextJob = 0;
+    pool->batch++;
+    lock.unlock();
+    pool->wake.notify_all();
+
+    drainJobs(pool);
+
+    // Every index has been handed out once drainJobs returns, so the batch is done
+    // when the workers still chewing on their last job have checked back in.
+    lock.lock();
+    pool->finished.wait(lock, [&] { return pool->busyWorkers == 0; });
+    pool->running = false;
+    pool->finished.notify_all();
+}
+
+#endif // __JOBS_H__
@@ -19,11 +19,12 @@
 #include "cr.h"
 
 #include "app.h"
+#include "assets.h"
 #include "debug.h"
 #include "obj-model.h"
 #include "opengl-helpers.h"
+#include "resources.h"
 #include "scenegraph.h"
-#include "thirdparty/lodepng/lodepng.h"
 #include "types.h"
 
 App app;
@@ -38,6 +39,10 @@ int BUFFER_HEIGHT = 920;
 
 const char *plugin = CR_PLUGIN("imalive");
 
+// Stand ins until the maps are loaded: grey, a flat normal, no spec and no glow.
+u8 placeholderTexels[4][4] = {
+    {128, 128, 128, 255}, {128, 128, 255, 255}, {0, 0, 0, 255}, {0, 0, 0, 255}};
+
 inline void Style() {
     /// 0 = FLAT APPEARENCE
     /// 1 = MORE "3D" LOOK
@@ -138,18 +143,6 @@ void clearImage(Image &image) {
     }
 }
 
-Png loadPNG(const char *filename) {
-    unsigned error;
-    unsigned char *buffer = 0;
-    unsigned width, height;
-
-    error = lodepng_decode32_file(&buffer, &width, &height, filename);
-    if (error)
-        printf("error %u: %s\n", error, lodepng_error_text(error));
-
-    return {.buffer = buffer, .width = width, .height = height};
-}
-
 void flipBufferU32(void* buffer, int width, int height) {
     float *tempRow = (float *)malloc(width * sizeof(u32));
 
@@ -376,13 +369,19 @@ void initAppDefaults() {
     cam.target = glm::vec3(0, 0, 0);
     cam.up = glm::vec3(0, 1, 0);
     cam.fov = 45.f;
+    cam.zNear = 0.01f;
+    cam.zFar = 1000.0f;
     cam.yaw =
         -90.0f; // yaw is initialized to -90.0 degrees since a yaw of 0.0 results in a direction
                 // vector pointing to the right so we initially rotate a bit to the left.
     cam.pitch = 0.0f;
     app.camera = cam;
-    app.diffuseTexture = {};
-    app.specTexture = {};
+    Png *textures[4] = {&app.diffuseTexture, &app.normalMapTexture, &app.specTexture,
+                        &app.glowTexture};
+    for (int i = 0; i < 4; i++) {
+        *textures[i] = {.buffer = placeholderTexels[i], .width = 1, .height = 1, .levelCount = 1};
+    }
+    app.textureFilter = TEXTURE_TRILINEAR;
 
     app.normalLength = 0.1f;
     app.lightDir = glm::vec3(3, 3, 3);
@@ -393,6 +392,10 @@ void initAppDefaults() {
 
     app.appTitle = "Tiny Renderer";
     app.renderMode = TRIANGLES;
+    app.rasterBackend = RASTER_AVX2;
+    app.deferredShading = false;
+    app.useLODs = true;
+    app.lodPixelError = 1.0f;
 }
 
 void initImGui(GLFWwindow *window) {
@@ -435,62 +438,46 @@ const char *getCurrentItemFromCurrentRenderMode() {
     }
 }
 
-void buildTree_r(Node *root) {
-    std::vector<Node *> children = root->children;
-    int childrenCount = children.size();
-    if (!childrenCount) {
+void buildTree_r(World *world, u32 node) {
+    u32 child = world->firstChild[node];
+    if (child == NO_NODE) {
         ImGui::Indent();
-        ImGui::Text("%s", root->name);
+        ImGui::Text("%s", world->names[node]);
         ImGui::Unindent();
         return;
     }
-    if (ImGui::TreeNodeEx(root->name)) {
-        for (int i = 0; i < childrenCount; i++) {
-            Node *child = (Node *)children[i];
-            buildTree_r(child);
+    if (ImGui::TreeNodeEx(world->names[node])) {
+        for (; child != NO_NODE; child = world->nextSibling[child]) {
+            buildTree_r(world, child);
         }
         ImGui::TreePop();
     }
 }
 
-void calcTangentSpace(Face &face) {
-    // tangents
-    glm::vec3 v0 = face.verts[0];
-    glm::vec3 v1 = face.verts[1];
-    glm::vec3 v2 = face.verts[2];
-
-    glm::vec3 uv0 = face.uvs[0];
-    glm::vec3 uv1 = face.uvs[1];
-    glm::vec3 uv2 = face.uvs[2];
-
-    glm::vec3 edge1 = v1 - v0;
-    glm::vec3 edge2 = v2 - v0;
-
-    glm::vec3 deltaUV1 = uv1 - uv0;
-    glm::vec3 deltaUV2 = uv2 - uv0;
-
-    float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
-
-    face.faceNormal = glm::cross(edge1, edge2);
-
-    glm::vec3 tangent, bitangent;
-    tangent.x = f * (deltaUV2.y * edge1.x - deltaUV1.y * edge2.x);
-    tangent.y = f * (deltaUV2.y * edge1.y - deltaUV1.y * edge2.y);
-    tangent.z = f * (deltaUV2.y * edge1.z - deltaUV1.y * edge2.z);
-    face.tangent = glm::normalize(tangent);
-
-    bitangent.x = f * (-deltaUV2.x * edge1.x + deltaUV1.x * edge2.x);
-    bitangent.y = f * (-deltaUV2.x * edge1.y + deltaUV1.x * edge2.y);
-    bitangent.z = f * (-deltaUV2.x * edge1.z + deltaUV1.x * edge2.z);
-
-    face.bitangent = glm::normalize(bitangent);
-
-    /* float r = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV1.y * deltaUV2.x); */
-    /* face.tangent = glm::normalize((edge1 * deltaUV2.y   - edge2 * deltaUV1.y)*r); */
-    /* face.bitangent = glm::normalize((edge2 * deltaUV1.x   - edge1 * deltaUV2.x)*r); */
+// The four maps are swapped in together once all of them are finished, one that failed to
+// load keeps its placeholder.
+void applyMaterialTextures(Asset **textures) {
+    Png *maps[4] = {&app.diffuseTexture, &app.normalMapTexture, &app.specTexture,
+                    &app.glowTexture};
+    for (int i = 0; i < 4; i++) {
+        if (textures[i]->state == ASSET_READY) {
+            *maps[i] = textures[i]->texture;
+        }
+    }
 }
 
-inline u32 rgbToU32(u8 r, u8 g, u8 b) { return r | g << 8 | b << 16 | (255 << 24); }
+const char *getAssetStateName(Asset *asset) {
+    switch (asset->state) {
+    case ASSET_QUEUED:
+        return "queued";
+    case ASSET_LOADING:
+        return "loading";
+    case ASSET_READY:
+        return "ready";
+    default:
+        return "failed";
+    }
+}
 
 int main(int argc, char **argv) {
     initAppDefaults();
@@ -529,91 +516,48 @@ int main(int argc, char **argv) {
     char fpsDisplay[12];
     //
 
-    Node worldRoot;
-    worldRoot.parent = NULL;
-    worldRoot.children = std::vector<Node *>();
-    worldRoot.name = "world";
-    worldRoot.type = "root";
-
     World world;
-    world.worldRoot = &worldRoot;
+    initWorld(&world);
     app.world = &world;
 
+    JobPool jobPool;
+    startJobPool(&jobPool, std::thread::hardware_concurrency());
+    app.jobs = &jobPool;
+
     std::string currentObj("../obj/diablo3_pose.obj");
+    MeshLibrary meshLibrary;
 
-    Transform t1;
-    t1.node.parent = &worldRoot;
-    t1.node.children = std::vector<Node *>();
-    t1.node.name = "diablo3_pose_root";
-    t1.node.type = "transform";
-    t1.matrix = glm::translate(glm::mat4(1), glm::vec3(0.0f, 0.0f, 0.0f));
-
-    Shape shape;
-    shape.node.parent = (Node *)&t1;
-    shape.node.name = "diablo3_pose";
-    shape.node.type = "shape";
-    shape.node.children = std::vector<Node *>();
-    loadOBJ(currentObj.c_str(), shape.faces, shape.vertices, shape.uvs, shape.normals);
-    for (int i=0; i < shape.faces.size(); i++) {
-        calcTangentSpace(shape.faces[i]);
-    }
-    t1.node.children.push_back((Node *)&shape);
-
-    Transform t2;
-    t2.node.parent = &worldRoot;
-    t2.node.children = std::vector<Node *>();
-    t2.node.name = "f16_root";
-    t2.node.type = "transform";
-    t2.matrix = glm::translate(glm::mat4(1), glm::vec3(2.0f, 0.0f, 0.0f));
-
-    Shape shapeF16;
-    shapeF16.node.parent = (Node *)&t2;
-    shapeF16.node.name = "f16";
-    shapeF16.node.type = "shape";
-    shapeF16.node.children = std::vector<Node *>();
-    loadOBJ("../obj/f16.obj", shapeF16.faces, shapeF16.vertices, shapeF16.uvs, shapeF16.normals);
-    for (int i=0; i < shapeF16.faces.size(); i++) {
-        calcTangentSpace(shapeF16.faces[i]);
-    }
-    t2.node.children.push_back((Node *)&shapeF16);
-
-    Transform t3;
-    t3.node.parent = &worldRoot;
-    t3.node.children = std::vector<Node *>();
-    t3.node.name = "armadillo_root";
-    t3.node.type = "transform";
-    glm::mat4 rotation = glm::rotate(glm::radians(90.1f), glm::vec3(0, 1, 0));
-    glm::mat4 scale = glm::scale(glm::vec3(0.5));
-    t3.matrix = scale * glm::translate(glm::mat4(1), glm::vec3(-2.0f, 0.0f, 0.0f)) * rotation;
-
-    Shape armadilloShape;
-    armadilloShape.node.parent = (Node *)&t3;
-    armadilloShape.node.name = "armadillo";
-    armadilloShape.node.type = "shape";
-    armadilloShape.node.children = std::vector<Node *>();
-    loadOBJ("../obj/armadillo.obj", armadilloShape.faces, armadilloShape.vertices,
-            armadilloShape.uvs, armadilloShape.normals);
-    for (int i=0; i < armadilloShape.faces.size(); i++) {
-        calcTangentSpace(armadilloShape.faces[i]);
-    }
-    t3.node.children.push_back((Node *)&armadilloShape);
+    // everything below loads in the background, the shapes and maps show up when ready
+    AssetLoader assetLoader;
+    startAssetLoader(&assetLoader, &meshLibrary, 4, std::thread::hardware_concurrency());
 
-    shape.node.parent = &worldRoot;
-    worldRoot.children.push_back((Node *)&t1);
-    /* worldRoot.children.push_back((Node *)&t2); */
-    /* worldRoot.children.push_back((Node *)&t3); */
+    u32 t1 = addTransform(&world, WORLD_ROOT, "diablo3_pose_root",
+                          glm::translate(glm::mat4(1), glm::vec3(0.0f, 0.0f, 0.0f)));
+    placeMesh(&assetLoader, t1, currentObj.c_str(), "diablo3_pose", false);
 
-    std::string diffuseTexture("../textures/diablo3_pose_diffuse.png");
-    app.diffuseTexture = loadPNG(diffuseTexture.c_str());
+    /* u32 t2 = addTransform(&world, WORLD_ROOT, "f16_root", */
+    /*                       glm::translate(glm::mat4(1), glm::vec3(2.0f, 0.0f, 0.0f))); */
+    /* placeMesh(&assetLoader, t2, "../obj/f16.obj", "f16", false); */
 
-    std::string normalMapTexture("../textures/diablo3_pose_nm_tangent.png");
-    app.normalMapTexture = loadPNG(normalMapTexture.c_str());
+    /* glm::mat4 rotation = glm::rotate(glm::radians(90.1f), glm::vec3(0, 1, 0)); */
+    /* glm::mat4 scale = glm::scale(glm::vec3(0.5)); */
+    /* u32 t3 = addTransform(&world, WORLD_ROOT, "armadillo_root", */
+    /*                       scale * glm::translate(glm::mat4(1), glm::vec3(-2.0f, 0.0f, 0.0f)) * */
+    /*                           rotation); */
+    /* placeMesh(&assetLoader, t3, "../obj/armadillo.obj", "armadillo", false); */
 
+    std::string diffuseTexture("../textures/diablo3_pose_diffuse.png");
+    std::string normalMapTexture("../textures/diablo3_pose_nm_tangent.png");
     std::string specTexture("../textures/diablo3_pose_spec.png");
-    app.specTexture = loadPNG(normalMapTexture.c_str());
-
     std::string glowTexture("../textures/diablo3_pose_glow.png");
-    app.glowTexture = loadPNG(glowTexture.c_str());
+
+    // diffuse, normal, spec, glow; applied together once all are finished
+    Asset *materialTextures[4] = {requestTexture(&assetLoader, diffuseTexture.c_str()),
+                                  requestTexture(&assetLoader, normalMapTexture.c_str()),
+                                  requestTexture(&assetLoader, specTexture.c_str()),
+                                  requestTexture(&assetLoader, glowTexture.c_str())};
+    bool materialPending = true;
+    Asset *importedTexture = NULL;
 
     cr_plugin ctx;
     ctx.userdata = &app;
@@ -649,6 +593,24 @@ int main(int argc, char **argv) {
             FPS = 9999;
         }
 
+        updateAssets(&assetLoader, &world);
+        if (materialPending && isAssetFinished(materialTextures[0]) &&
+            isAssetFinished(materialTextures[1]) && isAssetFinished(materialTextures[2]) &&
+            isAssetFinished(materialTextures[3])) {
+            applyMaterialTextures(materialTextures);
+            materialPending = false;
+        }
+        if (importedTexture && isAssetFinished(importedTexture)) {
+            // replaces the diffuse map only, also in the material if that is still loading
+            if (importedTexture->state == ASSET_READY) {
+                materialTextures[0] = importedTexture;
+                app.diffuseTexture = importedTexture->texture;
+            } else {
+                printf("Can't use %s as the diffuse map\n", importedTexture->path.c_str());
+            }
+            importedTexture = NULL;
+        }
+
         cr_plugin_update(ctx); // render
         flipBuffersVertically(app.image);
 
@@ -725,30 +687,38 @@ int main(int argc, char **argv) {
                 ImGui::EndMainMenuBar();
             }
 
-            /* if (ImGuiFileDialog::Instance()->Display("ChooseFileDlgKey")) { */
-
-            /*     if (ImGuiFileDialog::Instance()->IsOk()) { */
-            /*         std::string path = ImGuiFileDialog::Instance()->GetFilePathName(); */
-            /*         if (strstr(path.c_str(), ".obj")) { */
-            /*             currentObj = path; */
-            /*             modelData.faces.clear(); */
-            /*             modelData.vertices.clear(); */
-            /*             modelData.uvs.clear(); */
-            /*             modelData.normals.clear(); */
-
-            /*             loadOBJ(currentObj.c_str(), modelData.faces, modelData.vertices, */
-            /*                     modelData.uvs, app.modelData.normals); */
-            /*         } else if (strstr(path.c_str(), ".png")) { */
-            /*             diffuseTexture = path; */
-            /*             free(app.diffuseTexture.image); */
-            /*             app.diffuseTexture = loadPNG(path.c_str()); */
-            /*         } */
-            /*     } */
-            /*     ImGuiFileDialog::Instance()->Close(); */
-            /* } */
+            // imports only queue the file, the frame goes on while it loads
+            if (ImGuiFileDialog::Instance()->Display("ChooseFileDlgKey")) {
+
+                if (ImGuiFileDialog::Instance()->IsOk()) {
+                    std::string path = ImGuiFileDialog::Instance()->GetFilePathName();
+                    if (strstr(path.c_str(), ".obj")) {
+                        currentObj = path;
+                        placeMesh(&assetLoader, WORLD_ROOT, path.c_str(), NULL, false);
+                    } else if (strstr(path.c_str(), ".png")) {
+                        diffuseTexture = path;
+                        importedTexture = requestTexture(&assetLoader, path.c_str());
+                    }
+                }
+                ImGuiFileDialog::Instance()->Close();
+            }
+
+            if (getPendingAssetCount(&assetLoader)) {
+                ImGui::Begin("Loading");
+                u32 assetCount = assetLoader.assets.size();
+                ImGui::ProgressBar(float(assetLoader.finishedCount) / assetCount);
+                ImGui::Text("%u of %u assets", assetLoader.finishedCount, assetCount);
+                for (int i = 0; i < assetLoader.assets.size(); i++) {
+                    Asset *asset = assetLoader.assets[i];
+                    if (!isAssetFinished(asset)) {
+                        ImGui::Text("%s: %s", asset->name.c_str(), getAssetStateName(asset));
+                    }
+                }
+                ImGui::End();
+            }
 
             ImGui::Begin("Scene Graph");
-            buildTree_r(&worldRoot);
+            buildTree_r(&world, WORLD_ROOT);
             ImGui::End();
 
             ImGui::Begin("TinyRenderer");
@@ -786,6 +756,16 @@ int main(int argc, char **argv) {
                 ImGui::SliderFloat("normal length", &app.normalLength, 0.01f, 1.0f);
                 ImGui::SliderFloat("zdepth exp", &zdepthExponent, 0.001f, 4.015f);
 
+                const char *backends[] = {"Scalar", "SSE", "AVX2"};
+                ImGui::Combo("raster backend", (int *)&app.rasterBackend, backends,
+                             IM_ARRAYSIZE(backends));
+                ImGui::Checkbox("Deferred shading", &app.deferredShading);
+                const char *filters[] = {"Nearest", "Bilinear", "Trilinear"};
+                ImGui::Combo("texture filter", (int *)&app.textureFilter, filters,
+                             IM_ARRAYSIZE(filters));
+                ImGui::Checkbox("Mesh LODs", &app.useLODs);
+                ImGui::SliderFloat("LOD pixel error", &app.lodPixelError, 0.1f, 8.0f);
+
                 ImGui::Separator();
                 ImGui::Checkbox("Turntable", &app.turntable);
                 ImGui::SliderFloat("rotateY", &app.rotateY, -360, 360);
@@ -836,9 +816,11 @@ int main(int argc, char **argv) {
     }
 
     cr_plugin_close(ctx);
+    stopJobPool(&jobPool);
+    stopAssetLoader(&assetLoader); // frees the textures
+    freeMeshLibrary(&meshLibrary);
 
     // Cleanup
-    free(app.diffuseTexture.buffer);
     free(app.image.buffer);
     free(app.image.depth);
     free(app.image.zbuffer);
@@ -0,0 +1,335 @@
+#ifndef __MESH_CACHE_H__
+#define __MESH_CACHE_H__
+
+#include "bvh.h"
+#include "types.h"
+#include <algorithm>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Binary copy of a MeshResource, written next to the OBJ it came from as <obj>.meshcache.
+// It holds everything load time work produces: the optimized streams, tangents, bounds,
+// LODs and BVH. A header ties it to the source file and to this version of the format
+// and of the structs it stores raw. If anything doesn't match, the OBJ is loaded again
+// and the cache rewritten. Arrays are stored as a count followed by the elements, padded
+// to MESH_CACHE_ALIGNMENT.
+
+#define MESH_CACHE_MAGIC 0x434D5254 // "TRMC"
+// bump whenever the format or what the load time passes produce changes
+#define MESH_CACHE_VERSION 2
+#define MESH_CACHE_ALIGNMENT 16
+
+typedef struct MeshCacheHeader {
+    u32 magic;
+    u32 version;
+    u32 meshletSize;
+    u32 bvhNodeSize;
+    u64 sourceSize;
+    u64 sourceTime;
+    u32 lodCount;
+    u32 padding[3]; // arrays start 16 byte aligned
+} MeshCacheHeader;
+
+typedef struct MeshCacheReader {
+    const char *cursor;
+    const char *end;
+} MeshCacheReader;
+
+inline std::string getMeshCachePath(const char *objPath) {
+    return std::string(objPath) + ".meshcache";
+}
+
+// Caches are written under a name of their own and renamed into place once complete, so
+// a reader never sees half a file and two writers never share one. Failing to write one is
+// fine, the source is just loaded again next time.
+
+// The mode fopen would have created the cache with, mkstemp leaves out everyone but the
+// owner. umask can only be read by setting it, so that happens once.
+inline mode_t getCacheFileMode() {
+    static mode_t mode = [] {
+        mode_t mask = umask(0);
+        umask(mask);
+        return 0666 & ~mask;
+    }();
+    return mode;
+}
+
+// Opens the file to write the cache at cachePath to, tempPath gets its name.
+FILE *openCacheTempFile(const std::string &cachePath, std::string *tempPath) {
+    *tempPath = cachePath + ".XXXXXX";
+    int descriptor = mkstemp(&(*tempPath)[0]);
+    FILE *file = NULL;
+    if (descriptor >= 0 && fchmod(descriptor, getCacheFileMode()) == 0) {
+        file = fdopen(descriptor, "wb");
+    }
+    if (!file) {
+        printf("Can't write cache %s\n", cachePath.c_str());
+        if (descriptor >= 0) {
+            close(descriptor);
+            remove(tempPath->c_str());
+        }
+    }
+    return file;
+}
+
+// Closes a file from openCacheTempFile and moves it to cachePath.
+void finishCacheTempFile(FILE *file, const std::string &tempPath, const std::string &cachePath) {
+    bool written = !ferror(file);
+    written &= fclose(file) == 0;
+    if (!written || rename(tempPath.c_str(), cachePath.c_str()) != 0) {
+        printf("Can't write cache %s\n", cachePath.c_str());
+        remove(tempPath.c_str());
+    }
+}
+
+// The header a cache of the OBJ at path has to carry to be used, false without the OBJ.
+bool getMeshCacheHeader(const char *path, MeshCacheHeader *header) {
+    struct stat sourceInfo;
+    if (stat(path, &sourceInfo) < 0) {
+        return false;
+    }
+    memset(header, 0, sizeof(*header));
+    header->magic = MESH_CACHE_MAGIC;
+    header->version = MESH_CACHE_VERSION;
+    header->meshletSize = sizeof(Meshlet);
+    header->bvhNodeSize = sizeof(BVHNode);
+    header->sourceSize = sourceInfo.st_size;
+    header->sourceTime = sourceInfo.st_mtime;
+    return true;
+}
+
+inline void padMeshCache(FILE *file) {
+    static const char zeros[MESH_CACHE_ALIGNMENT] = {};
+    long position = ftell(file);
+    fwrite(zeros, 1, (MESH_CACHE_ALIGNMENT - position % MESH_CACHE_ALIGNMENT) %
+                         MESH_CACHE_ALIGNMENT, file);
+}
+
+template <typename T> void writeMeshCacheArray(FILE *file, std::vector<T> &array) {
+    u64 count = array.size();
+    fwrite(&count, sizeof(count), 1, file);
+    padMeshCache(file);
+    if (count) {
+        fwrite(array.data(), sizeof(T), count, file);
+    }
+    padMeshCache(file);
+}
+
+// Copies the next array out of the mapping, false if it runs past the end.
+template <typename T> bool readMeshCacheArray(MeshCacheReader *reader, std::vector<T> &array) {
+    u64 count;
+    if (reader->end - reader->cursor < MESH_CACHE_ALIGNMENT) {
+        return false;
+    }
+    memcpy(&count, reader->cursor, sizeof(count));
+    reader->cursor += MESH_CACHE_ALIGNMENT;
+
+    u64 size = count * sizeof(T);
+    if (count > (reader->end - reader->cursor) / sizeof(T)) {
+        return false;
+    }
+    array.resize(count);
+    if (count) {
+        memcpy(array.data(), reader->cursor, size);
+    }
+    reader->cursor += (size + MESH_CACHE_ALIGNMENT - 1) / MESH_CACHE_ALIGNMENT *
+                      MESH_CACHE_ALIGNMENT;
+    return true;
+}
+
+void writeMeshCacheMesh(FILE *file, Mesh &mesh) {
+    writeMeshCacheArray(file, mesh.positionX);
+    writeMeshCacheArray(file, mesh.positionY);
+    writeMeshCacheArray(file, mesh.positionZ);
+    writeMeshCacheArray(file, mesh.normalX);
+    writeMeshCacheArray(file, mesh.normalY);
+    writeMeshCacheArray(file, mesh.normalZ);
+    writeMeshCacheArray(file, mesh.u);
+    writeMeshCacheArray(file, mesh.v);
+    writeMeshCacheArray(file, mesh.indices);
+    writeMeshCacheArray(file, mesh.meshlets);
+    writeMeshCacheArray(file, mesh.tangentX);
+    writeMeshCacheArray(file, mesh.tangentY);
+    writeMeshCacheArray(file, mesh.tangentZ);
+    writeMeshCacheArray(file, mesh.bitangentX);
+    writeMeshCacheArray(file, mesh.bitangentY);
+    writeMeshCacheArray(file, mesh.bitangentZ);
+}
+
+bool readMeshCacheMesh(MeshCacheReader *reader, Mesh &mesh) {
+    return readMeshCacheArray(reader, mesh.positionX) &&
+           readMeshCacheArray(reader, mesh.positionY) &&
+           readMeshCacheArray(reader, mesh.positionZ) &&
+           readMeshCacheArray(reader, mesh.normalX) && readMeshCacheArray(reader, mesh.normalY) &&
+           readMeshCacheArray(reader, mesh.normalZ) && readMeshCacheArray(reader, mesh.u) &&
+           readMeshCacheArray(reader, mesh.v) && readMeshCacheArray(reader, mesh.indices) &&
+           readMeshCacheArray(reader, mesh.meshlets) &&
+           readMeshCacheArray(reader, mesh.tangentX) &&
+           readMeshCacheArray(reader, mesh.tangentY) &&
+           readMeshCacheArray(reader, mesh.tangentZ) &&
+           readMeshCacheArray(reader, mesh.bitangentX) &&
+           readMeshCacheArray(reader, mesh.bitangentY) &&
+           readMeshCacheArray(reader, mesh.bitangentZ);
+}
+
+// Whether every index in mesh stays inside the arrays it points into, so a cache that was
+// damaged but still parses is turned down instead of read past.
+bool isMeshCacheMeshValid(Mesh &mesh) {
+    u64 vertexCount = mesh.positionX.size();
+    u64 triangleCount = mesh.indices.size() / 3;
+    if (mesh.positionY.size() != vertexCount || mesh.positionZ.size() != vertexCount ||
+        mesh.normalX.size() != vertexCount || mesh.normalY.size() != vertexCount ||
+        mesh.normalZ.size() != vertexCount || mesh.u.size() != vertexCount ||
+        mesh.v.size() != vertexCount || mesh.indices.size() % 3 ||
+        mesh.tangentX.size() != triangleCount || mesh.tangentY.size() != triangleCount ||
+        mesh.tangentZ.size() != triangleCount || mesh.bitangentX.size() != triangleCount ||
+        mesh.bitangentY.size() != triangleCount || mesh.bitangentZ.size() != triangleCount) {
+        return false;
+    }
+    for (u64 i = 0; i < mesh.indices.size(); i++) {
+        if (mesh.indices[i] >= vertexCount) {
+            return false;
+        }
+    }
+    for (u64 i = 0; i < mesh.meshlets.size(); i++) {
+        Meshlet &meshlet = mesh.meshlets[i];
+        if (u64(meshlet.firstTriangle) + meshlet.triangleCount > triangleCount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Same for the BVH of a mesh with triangleCount triangles. Children come after their
+// parent as buildBVH lays them out, which also rules out cycles, and no leaf may be deeper
+// than the traversal stacks allow.
+bool isMeshCacheBVHValid(BVH &bvh, u64 triangleCount) {
+    // buildBVH leaves everything empty for a mesh without faces
+    if (!triangleCount) {
+        return bvh.nodes.empty() && bvh.triangles.empty() && bvh.corners.empty();
+    }
+    if (bvh.nodes.empty() || bvh.corners.size() != bvh.triangles.size() * 3) {
+        return false;
+    }
+    for (u64 i = 0; i < bvh.triangles.size(); i++) {
+        if (bvh.triangles[i] >= triangleCount) {
+            return false;
+        }
+    }
+    std::vector<u32> depths(bvh.nodes.size(), 0);
+    for (u64 i = 0; i < bvh.nodes.size(); i++) {
+        BVHNode &node = bvh.nodes[i];
+        if (node.count) {
+            if (u64(node.leftFirst) + node.count > bvh.triangles.size()) {
+                return false;
+            }
+        } else if (node.leftFirst <= i || u64(node.leftFirst) + 1 >= bvh.nodes.size() ||
+                   depths[i] >= BVH_MAX_DEPTH) {
+            return false;
+        } else {
+            depths[node.leftFirst] = std::max(depths[node.leftFirst], depths[i] + 1);
+            depths[node.leftFirst + 1] = std::max(depths[node.leftFirst + 1], depths[i] + 1);
+        }
+    }
+    return true;
+}
+
+// Fills resource from the cache of the OBJ at path. False when there is no cache or it
+// is stale, broken or from another version, resource is left half filled then.
+bool loadMeshCache(const char *path, MeshResource *resource) {
+    MeshCacheHeader expected;
+    if (!getMeshCacheHeader(path, &expected)) {
+        return false;
+    }
+
+    std::string cachePath = getMeshCachePath(path);
+    int file = open(cachePath.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat fileInfo;
+    size_t size = fstat(file, &fileInfo) < 0 ? 0 : fileInfo.st_size;
+    void *mapped = size < sizeof(MeshCacheHeader)
+                       ? MAP_FAILED
+                       : mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    MeshCacheHeader header;
+    memcpy(&header, mapped, sizeof(header));
+    expected.lodCount = header.lodCount;
+    bool loaded = !memcmp(&header, &expected, sizeof(header)) &&
+                  header.lodCount <= size / MESH_CACHE_ALIGNMENT;
+
+    if (loaded) {
+        MeshCacheReader reader = {.cursor = (const char *)mapped + sizeof(header),
+                                  .end = (const char *)mapped + size};
+        loaded = readMeshCacheMesh(&reader, resource->mesh);
+
+        resource->lods.resize(header.lodCount);
+        for (u32 i = 0; loaded && i < header.lodCount; i++) {
+            std::vector<float> error;
+            loaded = readMeshCacheArray(&reader, error) && error.size() == 1 &&
+                     readMeshCacheMesh(&reader, resource->lods[i].mesh);
+            resource->lods[i].error = loaded ? error[0] : 0;
+        }
+
+        std::vector<Bounds> bounds;
+        loaded = loaded && readMeshCacheArray(&reader, resource->bvh.nodes) &&
+                 readMeshCacheArray(&reader, resource->bvh.triangles) &&
+                 readMeshCacheArray(&reader, resource->bvh.corners) &&
+                 readMeshCacheArray(&reader, bounds) && bounds.size() == 1;
+        loaded = loaded && isMeshCacheMeshValid(resource->mesh) &&
+                 isMeshCacheBVHValid(resource->bvh, getMeshTriangleCount(resource->mesh));
+        for (u32 i = 0; loaded && i < header.lodCount; i++) {
+            loaded = isMeshCacheMeshValid(resource->lods[i].mesh);
+        }
+        if (loaded) {
+            resource->bounds = bounds[0];
+        }
+    }
+    munmap(mapped, size);
+    return loaded;
+}
+
+// Writes the cache of the OBJ at path.
+void saveMeshCache(const char *path, MeshResource *resource) {
+    MeshCacheHeader header;
+    if (!getMeshCacheHeader(path, &header)) {
+        return;
+    }
+    header.lodCount = resource->lods.size();
+
+    std::string cachePath = getMeshCachePath(path);
+    std::string tempPath;
+    FILE *file = openCacheTempFile(cachePath, &tempPath);
+    if (!file) {
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    writeMeshCacheMesh(file, resource->mesh);
+    for (u32 i = 0; i < header.lodCount; i++) {
+        std::vector<float> error(1, resource->lods[i].error);
+        writeMeshCacheArray(file, error);
+        writeMeshCacheMesh(file, resource->lods[i].mesh);
+    }
+    writeMeshCacheArray(file, resource->bvh.nodes);
+    writeMeshCacheArray(file, resource->bvh.triangles);
+    writeMeshCacheArray(file, resource->bvh.corners);
+    std::vector<Bounds> bounds(1, resource->bounds);
+    writeMeshCacheArray(file, bounds);
+
+    finishCacheTempFile(file, tempPath, cachePath);
+}
+
+#endif // __MESH_CACHE_H__
@@ -0,0 +1,205 @@
+#ifndef __MESHLET_H__
+#define __MESHLET_H__
+
+#include "clip.h"
+#include "types.h"
+#include <algorithm>
+#include <glm/gtx/transform.hpp>
+#include <vector>
+
+// Meshlets: the triangles of a mesh are reordered into clusters of up to
+// MESHLET_MAX_TRIANGLES neighbours, each with a bounding sphere and a cone around its
+// face normals. renderShape drops whole clusters that are outside the frustum or face
+// away from the eye before any per triangle work is done.
+
+#define MESHLET_MAX_TRIANGLES 64
+#define MESHLET_NO_CONE 2.0f
+#define MESHLET_MIN_NORMAL_DOT 0.7f // against the cluster's average, keeps cones narrow
+
+// Numbers the distinct positions of the mesh, so vertices split along UV seams or hard
+// edges can be treated as one. Returns the number of positions.
+u32 weldPositions(Mesh &mesh, std::vector<u32> &positionOf) {
+    u32 vertexCount = getMeshVertexCount(mesh);
+    std::vector<u32> sorted(vertexCount);
+    for (u32 i = 0; i < vertexCount; i++) {
+        sorted[i] = i;
+    }
+    std::sort(sorted.begin(), sorted.end(), [&](u32 a, u32 b) {
+        if (mesh.positionX[a] != mesh.positionX[b]) {
+            return mesh.positionX[a] < mesh.positionX[b];
+        }
+        if (mesh.positionY[a] != mesh.positionY[b]) {
+            return mesh.positionY[a] < mesh.positionY[b];
+        }
+        return mesh.positionZ[a] < mesh.positionZ[b];
+    });
+
+    positionOf.resize(vertexCount);
+    u32 positionCount = 0;
+    for (u32 i = 0; i < vertexCount; i++) {
+        if (i > 0 && getMeshPosition(mesh, sorted[i]) != getMeshPosition(mesh, sorted[i - 1])) {
+            positionCount++;
+        }
+        positionOf[sorted[i]] = positionCount;
+    }
+    return vertexCount ? positionCount + 1 : 0;
+}
+
+inline glm::vec3 getTriangleNormal(Mesh &mesh, u32 triangle) {
+    glm::vec3 p0 = getMeshPosition(mesh, mesh.indices[triangle * 3]);
+    glm::vec3 p1 = getMeshPosition(mesh, mesh.indices[triangle * 3 + 1]);
+    glm::vec3 p2 = getMeshPosition(mesh, mesh.indices[triangle * 3 + 2]);
+    glm::vec3 normal = glm::cross(p1 - p0, p2 - p0);
+    float length = glm::length(normal);
+    return length > 0 ? normal / length : glm::vec3(0);
+}
+
+// Sphere around the corners, cone around the face normals. The cone only exists when
+// all normals are within 90 degrees of their average.
+void computeMeshletBounds(Mesh &mesh, Meshlet &meshlet) {
+    u32 *indices = &mesh.indices[meshlet.firstTriangle * 3];
+    u32 cornerCount = meshlet.triangleCount * 3;
+
+    glm::vec3 min = getMeshPosition(mesh, indices[0]);
+    glm::vec3 max = min;
+    for (u32 i = 1; i < cornerCount; i++) {
+        min = glm::min(min, getMeshPosition(mesh, indices[i]));
+        max = glm::max(max, getMeshPosition(mesh, indices[i]));
+    }
+    meshlet.center = (min + max) * 0.5f;
+    meshlet.radius = 0;
+    for (u32 i = 0; i < cornerCount; i++) {
+        glm::vec3 offset = getMeshPosition(mesh, indices[i]) - meshlet.center;
+        meshlet.radius = glm::max(meshlet.radius, glm::length(offset));
+    }
+
+    glm::vec3 normalSum(0);
+    for (u32 i = 0; i < meshlet.triangleCount; i++) {
+        normalSum += getTriangleNormal(mesh, meshlet.firstTriangle + i);
+    }
+    meshlet.coneCutoff = MESHLET_NO_CONE;
+    float length = glm::length(normalSum);
+    if (length <= 0) {
+        return;
+    }
+    meshlet.coneAxis = normalSum / length;
+
+    float minDot = 1;
+    for (u32 i = 0; i < meshlet.triangleCount; i++) {
+        glm::vec3 normal = getTriangleNormal(mesh, meshlet.firstTriangle + i);
+        if (normal != glm::vec3(0)) {
+            minDot = glm::min(minDot, glm::dot(normal, meshlet.coneAxis));
+        }
+    }
+    if (minDot > 0) {
+        meshlet.coneCutoff = sqrtf(1 - minDot * minDot);
+    }
+}
+
+// Grows clusters breadth first over shared positions, starting from the first triangle not
+// taken yet, and reorders the triangle list so every cluster is one range. Triangles
+// bent too far away from what the cluster has so far are left for a later one, they
+// would make its cone useless. Per triangle streams have to be rebuilt afterwards.
+void buildMeshlets(Mesh &mesh) {
+    u32 triangleCount = getMeshTriangleCount(mesh);
+    mesh.meshlets.clear();
+
+    std::vector<u32> positionOf;
+    u32 positionCount = weldPositions(mesh, positionOf);
+
+    std::vector<glm::vec3> normals(triangleCount);
+    for (u32 t = 0; t < triangleCount; t++) {
+        normals[t] = getTriangleNormal(mesh, t);
+    }
+
+    // triangles around each position, positionTriangles[start[p]..start[p + 1]]
+    std::vector<u32> start(positionCount + 1, 0);
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        start[positionOf[mesh.indices[i]] + 1]++;
+    }
+    for (u32 p = 0; p < positionCount; p++) {
+        start[p + 1] += start[p];
+    }
+    std::vector<u32> positionTriangles(triangleCount * 3);
+    std::vector<u32> fill(start.begin(), start.end() - 1);
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        positionTriangles[fill[positionOf[mesh.indices[i]]]++] = i / 3;
+    }
+
+    std::vector<bool> taken(triangleCount, false);
+    std::vector<u32> order;
+    std::vector<u32> candidates;
+    order.reserve(triangleCount);
+
+    for (u32 seed = 0; seed < triangleCount; seed++) {
+        if (taken[seed]) {
+            continue;
+        }
+
+        Meshlet meshlet = {};
+        meshlet.firstTriangle = order.size();
+        glm::vec3 normalSum(0);
+
+        candidates.clear();
+        candidates.push_back(seed);
+        for (int next = 0; next < candidates.size(); next++) {
+            u32 t = candidates[next];
+            if (taken[t]) {
+                continue;
+            }
+            float normalSumLength = glm::length(normalSum);
+            if (normalSumLength > 0 && normals[t] != glm::vec3(0) &&
+                glm::dot(normals[t], normalSum) < MESHLET_MIN_NORMAL_DOT * normalSumLength) {
+                continue;
+            }
+
+            taken[t] = true;
+            order.push_back(t);
+            normalSum += normals[t];
+            if (++meshlet.triangleCount == MESHLET_MAX_TRIANGLES) {
+                break;
+            }
+
+            for (int k = 0; k < 3; k++) {
+                u32 p = positionOf[mesh.indices[t * 3 + k]];
+                for (u32 i = start[p]; i < start[p + 1]; i++) {
+                    if (!taken[positionTriangles[i]]) {
+                        candidates.push_back(positionTriangles[i]);
+                    }
+                }
+            }
+        }
+        mesh.meshlets.push_back(meshlet);
+    }
+
+    std::vector<u32> indices(triangleCount * 3);
+    for (u32 t = 0; t < triangleCount; t++) {
+        for (int k = 0; k < 3; k++) {
+            indices[t * 3 + k] = mesh.indices[order[t] * 3 + k];
+        }
+    }
+    mesh.indices.swap(indices);
+
+    for (int i = 0; i < mesh.meshlets.size(); i++) {
+        computeMeshletBounds(mesh, mesh.meshlets[i]);
+    }
+}
+
+// True when the whole cluster can be skipped: its sphere is outside one of the frustum
+// planes or, with back-face culling on, every triangle in it faces away from eye. The
+// planes and eye are in the object space of the mesh, where facing is the same test as
+// on screen.
+inline bool isMeshletCulled(Meshlet &meshlet, glm::vec4 *planes, glm::vec3 eye,
+                            bool cullBackFaces) {
+    if (isSphereOutsideFrustum(planes, meshlet.center, meshlet.radius)) {
+        return true;
+    }
+    if (!cullBackFaces || meshlet.coneCutoff == MESHLET_NO_CONE) {
+        return false;
+    }
+    glm::vec3 toCenter = meshlet.center - eye;
+    return glm::dot(toCenter, meshlet.coneAxis) >=
+           meshlet.coneCutoff * glm::length(toCenter) + meshlet.radius;
+}
+
+#endif // __MESHLET_H__
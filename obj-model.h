@@ -1,113 +1,494 @@
 #ifndef __OBJ_MODEL_H__
 #define __OBJ_MODEL_H__
 
+#include "debug.h"
+#include "jobs.h"
+#include "optimize.h"
 #include "types.h"
+#include <fcntl.h>
 #include <glm/gtx/transform.hpp>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
-bool loadOBJ(const char *path, std::vector<Face> &out_faces, std::vector<glm::vec3> &out_vertices,
-             std::vector<glm::vec3> &out_uvs, std::vector<glm::vec3> &out_normals) {
+#define OBJ_NO_INDEX 0xFFFFFFFF
+#define OBJ_MIN_CHUNK_SIZE (256 * 1024)
+#define OBJ_CHUNKS_PER_THREAD 4
 
-    printf("Loading OBJ file %s...\n", path);
+// One face corner as written in the file, 0 based, OBJ_NO_INDEX when missing.
+typedef struct OBJCorner {
+    u32 position;
+    u32 uv;
+    u32 normal;
+} OBJCorner;
 
-    FILE *file = fopen(path, "r");
-    if (file == NULL) {
-        printf("Impossible to open the file ! Are you in the right path ? See "
-               "Tutorial 1 for details\n");
-        getchar();
+// A run of whole lines of the file, parsed by one job. The counts come from a first pass
+// over the chunk, the first* offsets from adding up the counts of the chunks before it.
+typedef struct OBJChunk {
+    const char *begin;
+    const char *end;
+    u32 positionCount;
+    u32 uvCount;
+    u32 normalCount;
+    u32 triangleCount;
+    u32 firstPosition;
+    u32 firstUV;
+    u32 firstNormal;
+    u32 firstTriangle;
+    bool failed;
+} OBJChunk;
+
+// Raw attributes and faces of the whole file, only needed until the corners are resolved
+// into mesh vertices.
+typedef struct OBJData {
+    std::vector<OBJChunk> chunks;
+    std::vector<glm::vec3> positions;
+    std::vector<glm::vec2> uvs;
+    std::vector<glm::vec3> normals;
+    std::vector<OBJCorner> corners; // three per triangle
+} OBJData;
+
+inline bool isOBJSpace(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *skipOBJSpaces(const char *c, const char *end) {
+    while (c < end && isOBJSpace(*c)) {
+        c++;
+    }
+    return c;
+}
+
+inline const char *skipOBJLine(const char *c, const char *end) {
+    const char *newline = (const char *)memchr(c, '\n', end - c);
+    return newline ? newline + 1 : end;
+}
+
+// Two character keyword at c, followed by a space: "v ", "vt", "vn", "f ".
+inline bool isOBJKeyword(const char *c, const char *end, char first, char second) {
+    if (end - c < 2 || c[0] != first) {
         return false;
     }
+    return second == ' ' ? isOBJSpace(c[1]) : c[1] == second;
+}
 
-    char *line = NULL;
-    ssize_t read;
-    size_t len = 0;
+// Anything parseFloat can't do exactly, copied out since the mapped file isn't 0
+// terminated.
+const char *parseFloatSlow(const char *c, const char *end, float *out) {
+    char token[64];
+    int length = 0;
+    while (c + length < end && length < int(sizeof(token)) - 1 && !isOBJSpace(c[length]) &&
+           c[length] != '\n') {
+        token[length] = c[length];
+        length++;
+    }
+    token[length] = 0;
+    char *parsedEnd;
+    *out = strtof(token, &parsedEnd);
+    return parsedEnd == token ? NULL : c + (parsedEnd - token);
+}
 
-    while ((read = getline(&line, &len, file)) != -1) {
+// Decimal number at c, NULL when there is none. Up to 15 significant digits and a power
+// of ten of at most 22 are both exact doubles, so one multiply or divide and the cast
+// give the same float as strtof, unless the double lands exactly halfway between two
+// floats. That case, longer numbers and anything unusual go through strtof.
+const char *parseFloat(const char *c, const char *end, float *out) {
+    static const double powersOf10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                        1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                        1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char *start = c;
+    bool negative = false;
+    if (c < end && (*c == '-' || *c == '+')) {
+        negative = *c == '-';
+        c++;
+    }
 
-        if (len == 0) {
-            continue;
+    u64 mantissa = 0;
+    int digits = 0;
+    int exponent = 0;
+    bool anyDigits = false;
+    for (; c < end && *c >= '0' && *c <= '9'; c++) {
+        mantissa = mantissa * 10 + (*c - '0');
+        digits += mantissa != 0;
+        anyDigits = true;
+        if (digits > 15) {
+            return parseFloatSlow(start, end, out);
         }
-
-        char dataType = line[0];
-
-        if (dataType == 'v') {
-            char secondChar = line[1];
-            if (secondChar == ' ') {
-                glm::vec3 vertex;
-                sscanf(line, "v %f %f %f\n", &vertex.x, &vertex.y, &vertex.z);
-                out_vertices.push_back(vertex);
-
-            } else if (secondChar == 't') {
-                glm::vec3 uv;
-                sscanf(line, "vt %f %f %f\n", &uv.x, &uv.y, &uv.z);
-                out_uvs.push_back(uv);
-
-            } else if (secondChar == 'n') {
-                glm::vec3 normal;
-                char *str;
-                sscanf(line, "vn %f %f %f\n", &normal.x, &normal.y, &normal.z);
-                out_normals.push_back(normal);
+    }
+    if (c < end && *c == '.') {
+        for (c++; c < end && *c >= '0' && *c <= '9'; c++) {
+            mantissa = mantissa * 10 + (*c - '0');
+            digits += mantissa != 0;
+            exponent--;
+            anyDigits = true;
+            if (digits > 15) {
+                return parseFloatSlow(start, end, out);
             }
+        }
+    }
+    if (!anyDigits) {
+        return parseFloatSlow(start, end, out);
+    }
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        c++;
+        bool negativeExponent = false;
+        if (c < end && (*c == '-' || *c == '+')) {
+            negativeExponent = *c == '-';
+            c++;
+        }
+        int value = 0;
+        for (; c < end && *c >= '0' && *c <= '9' && value < 1000; c++) {
+            value = value * 10 + (*c - '0');
+        }
+        exponent += negativeExponent ? -value : value;
+    }
+    if (c < end && !isOBJSpace(*c) && *c != '\n') {
+        return parseFloatSlow(start, end, out);
+    }
+
+    if (mantissa == 0) {
+        *out = negative ? -0.0f : 0.0f;
+        return c;
+    }
+    if (exponent < -22 || exponent > 22) {
+        return parseFloatSlow(start, end, out);
+    }
+    double value = exponent < 0 ? double(mantissa) / powersOf10[-exponent]
+                                : double(mantissa) * powersOf10[exponent];
+    u64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x1FFFFFFF) == 0x10000000) {
+        return parseFloatSlow(start, end, out);
+    }
+    *out = float(negative ? -value : value);
+    return c;
+}
 
-        } else if (dataType == 'f') {
-            std::vector<int> f;
-            unsigned int vertexIndex[3], uvIndex[3], normalIndex[3];
-            int matches = sscanf(line, "f %d/%d/%d %d/%d/%d %d/%d/%d\n", &vertexIndex[0],
-                                 &uvIndex[0], &normalIndex[0], &vertexIndex[1], &uvIndex[1],
-                                 &normalIndex[1], &vertexIndex[2], &uvIndex[2], &normalIndex[2]);
-
-            Face face;
-
-            if (matches != 9) {
-                matches =
-                    sscanf(line, "f %d//%d %d//%d %d//%d\n", &vertexIndex[0], &normalIndex[0],
-                           &vertexIndex[1], &normalIndex[1], &vertexIndex[2], &normalIndex[2]);
-                if (matches != 6) {
-                    matches = sscanf(line, "f %d %d %d\n", &vertexIndex[0], &vertexIndex[1],
-                                     &vertexIndex[2]);
-                    if (matches != 3) {
-                        printf("File can't be read by our simple parser. Try exporting with "
-                               "other options\n");
-                        fclose(file);
-                        return false;
-                    } else {
-                        face.verts[0] = out_vertices[--vertexIndex[0]];
-                        face.verts[1] = out_vertices[--vertexIndex[1]];
-                        face.verts[2] = out_vertices[--vertexIndex[2]];
-                    }
-                } else {
-
-                    face.verts[0] = out_vertices[--vertexIndex[0]];
-                    face.verts[1] = out_vertices[--vertexIndex[1]];
-                    face.verts[2] = out_vertices[--vertexIndex[2]];
-
-                    face.normals[0] = out_normals[--normalIndex[0]];
-                    face.normals[1] = out_normals[--normalIndex[1]];
-                    face.normals[2] = out_normals[--normalIndex[2]];
-                }
+// 1 based or, when negative, relative index at c, turned into a 0 based one. count is the
+// number of elements of its kind declared before the line.
+const char *parseOBJIndex(const char *c, const char *end, u32 count, u32 *out) {
+    bool negative = c < end && *c == '-';
+    if (negative) {
+        c++;
+    }
+    const char *digitsStart = c;
+    u64 value = 0;
+    for (; c < end && *c >= '0' && *c <= '9' && value <= 0xFFFFFFFF; c++) {
+        value = value * 10 + (*c - '0');
+    }
+    if (c == digitsStart || value == 0 || value > 0xFFFFFFFF) {
+        return NULL;
+    }
+    if (negative) {
+        if (value > count) {
+            return NULL;
+        }
+        *out = count - u32(value);
+    } else {
+        *out = u32(value - 1);
+    }
+    return c;
+}
 
+// v, v/vt, v//vn or v/vt/vn.
+const char *parseOBJCorner(const char *c, const char *end, u32 positionsSoFar, u32 uvsSoFar,
+                           u32 normalsSoFar, OBJCorner *corner) {
+    corner->uv = OBJ_NO_INDEX;
+    corner->normal = OBJ_NO_INDEX;
+    c = parseOBJIndex(c, end, positionsSoFar, &corner->position);
+    if (!c || c == end || *c != '/') {
+        return c;
+    }
+    c++;
+    if (c < end && *c != '/') {
+        c = parseOBJIndex(c, end, uvsSoFar, &corner->uv);
+        if (!c || c == end || *c != '/') {
+            return c;
+        }
+    }
+    return parseOBJIndex(c + 1, end, normalsSoFar, &corner->normal);
+}
+
+void countOBJChunk(void *userdata, int jobIndex) {
+    OBJChunk &chunk = ((OBJData *)userdata)->chunks[jobIndex];
+    for (const char *line = chunk.begin; line < chunk.end; line = skipOBJLine(line, chunk.end)) {
+        const char *c = skipOBJSpaces(line, chunk.end);
+        if (isOBJKeyword(c, chunk.end, 'v', ' ')) {
+            chunk.positionCount++;
+        } else if (isOBJKeyword(c, chunk.end, 'v', 't')) {
+            chunk.uvCount++;
+        } else if (isOBJKeyword(c, chunk.end, 'v', 'n')) {
+            chunk.normalCount++;
+        } else if (isOBJKeyword(c, chunk.end, 'f', ' ')) {
+            chunk.triangleCount++;
+        }
+    }
+}
+
+// Fills the chunk's ranges of the attribute and corner arrays. Only the first three
+// corners of a face are used, like the loader always did.
+void parseOBJChunk(void *userdata, int jobIndex) {
+    OBJData *data = (OBJData *)userdata;
+    OBJChunk &chunk = data->chunks[jobIndex];
+    const char *end = chunk.end;
+    u32 position = chunk.firstPosition;
+    u32 uv = chunk.firstUV;
+    u32 normal = chunk.firstNormal;
+    u32 triangle = chunk.firstTriangle;
+
+    for (const char *line = chunk.begin; line < end; line = skipOBJLine(line, end)) {
+        const char *c = skipOBJSpaces(line, end);
+        if (isOBJKeyword(c, end, 'v', ' ')) {
+            glm::vec3 &p = data->positions[position++];
+            c = parseFloat(skipOBJSpaces(c + 1, end), end, &p.x);
+            c = c ? parseFloat(skipOBJSpaces(c, end), end, &p.y) : NULL;
+            c = c ? parseFloat(skipOBJSpaces(c, end), end, &p.z) : NULL;
+        } else if (isOBJKeyword(c, end, 'v', 't')) {
+            glm::vec2 &t = data->uvs[uv++];
+            c = parseFloat(skipOBJSpaces(c + 2, end), end, &t.x);
+            c = c ? skipOBJSpaces(c, end) : NULL;
+            // v may be left out, it is 0 then
+            if (c && (c == end || *c == '\n')) {
+                t.y = 0;
             } else {
-                face.verts[0] = out_vertices[--vertexIndex[0]];
-                face.verts[1] = out_vertices[--vertexIndex[1]];
-                face.verts[2] = out_vertices[--vertexIndex[2]];
+                c = c ? parseFloat(c, end, &t.y) : NULL;
+            }
+        } else if (isOBJKeyword(c, end, 'v', 'n')) {
+            glm::vec3 &n = data->normals[normal++];
+            c = parseFloat(skipOBJSpaces(c + 2, end), end, &n.x);
+            c = c ? parseFloat(skipOBJSpaces(c, end), end, &n.y) : NULL;
+            c = c ? parseFloat(skipOBJSpaces(c, end), end, &n.z) : NULL;
+        } else if (isOBJKeyword(c, end, 'f', ' ')) {
+            OBJCorner *corners = &data->corners[triangle++ * 3];
+            c++;
+            for (int k = 0; k < 3 && c; k++) {
+                c = parseOBJCorner(skipOBJSpaces(c, end), end, position, uv, normal,
+                                   &corners[k]);
+            }
+        }
+        if (!c) {
+            chunk.failed = true;
+            return;
+        }
+    }
+}
 
-                face.uvs[0] = out_uvs[--uvIndex[0]];
-                face.uvs[1] = out_uvs[--uvIndex[1]];
-                face.uvs[2] = out_uvs[--uvIndex[2]];
+// Splits the file into about the given number of chunks, each ending after a newline.
+void splitOBJChunks(const char *begin, const char *end, int count,
+                    std::vector<OBJChunk> &chunks) {
+    size_t chunkSize = (end - begin) / count + 1;
+    if (chunkSize < OBJ_MIN_CHUNK_SIZE) {
+        chunkSize = OBJ_MIN_CHUNK_SIZE;
+    }
+    for (const char *c = begin; c < end;) {
+        OBJChunk chunk = {};
+        chunk.begin = c;
+        chunk.end = end - c > chunkSize ? skipOBJLine(c + chunkSize, end) : end;
+        chunks.push_back(chunk);
+        c = chunk.end;
+    }
+}
 
-                face.normals[0] = out_normals[--normalIndex[0]];
-                face.normals[1] = out_normals[--normalIndex[1]];
-                face.normals[2] = out_normals[--normalIndex[2]];
+// Turns every distinct v/vt/vn triple into one mesh vertex, numbered in the order they
+// first show up. The vertices sharing a position are chained, so finding a triple only
+// looks at the few split along a seam. False when an index points past its array.
+bool buildOBJMesh(OBJData &data, Mesh &mesh) {
+    u32 positionCount = data.positions.size();
+    u32 uvCount = data.uvs.size();
+    u32 normalCount = data.normals.size();
+    u32 cornerCount = data.corners.size();
+
+    std::vector<u32> firstVertexAt(positionCount, OBJ_NO_INDEX);
+    std::vector<u32> nextVertexAt;
+    std::vector<u32> cornerOf; // first corner of every mesh vertex
+    mesh.indices.resize(cornerCount);
+
+    for (u32 i = 0; i < cornerCount; i++) {
+        OBJCorner &corner = data.corners[i];
+        if (corner.position >= positionCount ||
+            (corner.uv != OBJ_NO_INDEX && corner.uv >= uvCount) ||
+            (corner.normal != OBJ_NO_INDEX && corner.normal >= normalCount)) {
+            mesh.indices.clear();
+            return false;
+        }
+
+        u32 vertex = firstVertexAt[corner.position];
+        while (vertex != OBJ_NO_INDEX) {
+            OBJCorner &other = data.corners[cornerOf[vertex]];
+            if (other.uv == corner.uv && other.normal == corner.normal) {
+                break;
             }
+            vertex = nextVertexAt[vertex];
+        }
+        if (vertex == OBJ_NO_INDEX) {
+            vertex = cornerOf.size();
+            cornerOf.push_back(i);
+            nextVertexAt.push_back(firstVertexAt[corner.position]);
+            firstVertexAt[corner.position] = vertex;
+        }
+        mesh.indices[i] = vertex;
+    }
+
+    u32 vertexCount = cornerOf.size();
+    mesh.positionX.resize(vertexCount);
+    mesh.positionY.resize(vertexCount);
+    mesh.positionZ.resize(vertexCount);
+    mesh.normalX.resize(vertexCount);
+    mesh.normalY.resize(vertexCount);
+    mesh.normalZ.resize(vertexCount);
+    mesh.u.resize(vertexCount);
+    mesh.v.resize(vertexCount);
+    for (u32 i = 0; i < vertexCount; i++) {
+        OBJCorner &corner = data.corners[cornerOf[i]];
+        glm::vec3 position = data.positions[corner.position];
+        glm::vec2 uv = corner.uv == OBJ_NO_INDEX ? glm::vec2(0) : data.uvs[corner.uv];
+        glm::vec3 normal =
+            corner.normal == OBJ_NO_INDEX ? glm::vec3(0) : data.normals[corner.normal];
+        mesh.positionX[i] = position.x;
+        mesh.positionY[i] = position.y;
+        mesh.positionZ[i] = position.z;
+        mesh.normalX[i] = normal.x;
+        mesh.normalY[i] = normal.y;
+        mesh.normalZ[i] = normal.z;
+        mesh.u[i] = uv.x;
+        mesh.v[i] = uv.y;
+    }
+    return true;
+}
+
+// Fills the per triangle tangent streams from the positions and UVs.
+void calcTangentSpace(Mesh &mesh) {
+    u32 triangleCount = getMeshTriangleCount(mesh);
+    mesh.tangentX.resize(triangleCount);
+    mesh.tangentY.resize(triangleCount);
+    mesh.tangentZ.resize(triangleCount);
+    mesh.bitangentX.resize(triangleCount);
+    mesh.bitangentY.resize(triangleCount);
+    mesh.bitangentZ.resize(triangleCount);
+
+    for (u32 i = 0; i < triangleCount; i++) {
+        u32 i0 = mesh.indices[i * 3];
+        u32 i1 = mesh.indices[i * 3 + 1];
+        u32 i2 = mesh.indices[i * 3 + 2];
+
+        glm::vec3 v0 = getMeshPosition(mesh, i0);
+        glm::vec3 edge1 = getMeshPosition(mesh, i1) - v0;
+        glm::vec3 edge2 = getMeshPosition(mesh, i2) - v0;
+
+        glm::vec2 deltaUV1 = glm::vec2(mesh.u[i1] - mesh.u[i0], mesh.v[i1] - mesh.v[i0]);
+        glm::vec2 deltaUV2 = glm::vec2(mesh.u[i2] - mesh.u[i0], mesh.v[i2] - mesh.v[i0]);
+
+        float f = 1.0f / (deltaUV1.x * deltaUV2.y - deltaUV2.x * deltaUV1.y);
+
+        glm::vec3 tangent = glm::normalize(f * (deltaUV2.y * edge1 - deltaUV1.y * edge2));
+        glm::vec3 bitangent = glm::normalize(f * (-deltaUV2.x * edge1 + deltaUV1.x * edge2));
+
+        mesh.tangentX[i] = tangent.x;
+        mesh.tangentY[i] = tangent.y;
+        mesh.tangentZ[i] = tangent.z;
+        mesh.bitangentX[i] = bitangent.x;
+        mesh.bitangentY[i] = bitangent.y;
+        mesh.bitangentZ[i] = bitangent.z;
+    }
+}
+
+// Maps the file and parses it in chunks across jobs: one pass counts the elements of
+// every chunk so the arrays are allocated once, a second one parses each chunk straight
+// into its own ranges. Only resolving the corners into mesh vertices is serial.
+bool loadOBJ(const char *path, Mesh &out_mesh, JobPool *jobs) {
 
-            out_faces.push_back(face);
+    printf("Loading OBJ file %s...\n", path);
+
+    int file = open(path, O_RDONLY);
+    struct stat fileInfo;
+    if (file < 0 || fstat(file, &fileInfo) < 0) {
+        printf("Impossible to open the file ! Are you in the right path ? See "
+               "Tutorial 1 for details\n");
+        if (file >= 0) {
+            close(file);
         }
+        return false;
+    }
+
+    size_t size = fileInfo.st_size;
+    const char *text = NULL;
+    if (size) {
+        void *mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+        text = mapped == MAP_FAILED ? NULL : (const char *)mapped;
+    }
+    close(file);
+    if (size && !text) {
+        printf("Impossible to map the file %s\n", path);
+        return false;
+    }
+
+    OBJData data;
+    splitOBJChunks(text, text + size, jobThreadCount(jobs) * OBJ_CHUNKS_PER_THREAD, data.chunks);
+    runJobs(jobs, countOBJChunk, &data, data.chunks.size());
+
+    u32 positionCount = 0;
+    u32 uvCount = 0;
+    u32 normalCount = 0;
+    u32 triangleCount = 0;
+    for (int i = 0; i < data.chunks.size(); i++) {
+        OBJChunk &chunk = data.chunks[i];
+        chunk.firstPosition = positionCount;
+        chunk.firstUV = uvCount;
+        chunk.firstNormal = normalCount;
+        chunk.firstTriangle = triangleCount;
+        positionCount += chunk.positionCount;
+        uvCount += chunk.uvCount;
+        normalCount += chunk.normalCount;
+        triangleCount += chunk.triangleCount;
     }
+    data.positions.resize(positionCount);
+    data.uvs.resize(uvCount);
+    data.normals.resize(normalCount);
+    data.corners.resize(triangleCount * 3);
+    runJobs(jobs, parseOBJChunk, &data, data.chunks.size());
 
-    fclose(file);
+    bool failed = false;
+    for (int i = 0; i < data.chunks.size(); i++) {
+        failed |= data.chunks[i].failed;
+    }
+    if (size) {
+        munmap((void *)text, size);
+    }
+    if (failed || !buildOBJMesh(data, out_mesh)) {
+        printf("File can't be read by our simple parser. Try exporting with "
+               "other options\n");
+        return false;
+    }
+
+    optimizeMesh(out_mesh);
+    calcTangentSpace(out_mesh);
 
     print("data loaded successfully");
     return true;
 }
 
+// Box around all vertices, sphere centered on the box and grown to the furthest vertex.
+Bounds computeBounds(Mesh &mesh) {
+    Bounds bounds = {};
+    u32 vertexCount = getMeshVertexCount(mesh);
+    if (!vertexCount) {
+        return bounds;
+    }
+
+    bounds.min = getMeshPosition(mesh, 0);
+    bounds.max = bounds.min;
+    for (u32 i = 1; i < vertexCount; i++) {
+        bounds.min = glm::min(bounds.min, getMeshPosition(mesh, i));
+        bounds.max = glm::max(bounds.max, getMeshPosition(mesh, i));
+    }
+
+    bounds.center = (bounds.min + bounds.max) * 0.5f;
+    for (u32 i = 0; i < vertexCount; i++) {
+        bounds.radius =
+            glm::max(bounds.radius, glm::length(getMeshPosition(mesh, i) - bounds.center));
+    }
+    return bounds;
+}
+
 #endif //__OBJ_MODEL_H__
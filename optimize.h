@@ -0,0 +1,252 @@
+#ifndef __OPTIMIZE_H__
+#define __OPTIMIZE_H__
+
+#include "meshlet.h"
+#include "types.h"
+#include <algorithm>
+#include <glm/gtx/transform.hpp>
+#include <vector>
+
+// Load time reordering of a mesh, none of it changes what ends up on screen:
+// - triangles inside a meshlet follow Tipsify (Sander et al. 2007), so corners that are
+//   gathered one after another during triangle setup were transformed close together
+// - meshlets are sorted so the ones likely in front come first, fewer fragments get
+//   shaded just to be overwritten
+// - vertices are renumbered in the order the triangles first use them
+
+#define OPTIMIZE_CACHE_SIZE 16
+#define OPTIMIZE_NO_VERTEX 0xFFFFFFFF
+
+// Next vertex to fan around: the candidate whose triangles would still find the most
+// of their corners in the cache, else the last dead end with triangles left, else the
+// next such vertex in index order. OPTIMIZE_NO_VERTEX when everything is emitted.
+u32 getNextTipsifyVertex(std::vector<u32> &candidates, std::vector<u32> &liveTriangles,
+                         std::vector<u32> &cacheTime, u32 time, std::vector<u32> &deadEnds,
+                         u32 &cursor) {
+    u32 best = OPTIMIZE_NO_VERTEX;
+    int bestPriority = -1;
+    for (int i = 0; i < candidates.size(); i++) {
+        u32 vertex = candidates[i];
+        if (liveTriangles[vertex] == 0) {
+            continue;
+        }
+        int priority = 0;
+        if (time - cacheTime[vertex] + 2 * liveTriangles[vertex] <= OPTIMIZE_CACHE_SIZE) {
+            priority = time - cacheTime[vertex];
+        }
+        if (priority > bestPriority) {
+            bestPriority = priority;
+            best = vertex;
+        }
+    }
+    if (best != OPTIMIZE_NO_VERTEX) {
+        return best;
+    }
+
+    while (!deadEnds.empty()) {
+        u32 vertex = deadEnds.back();
+        deadEnds.pop_back();
+        if (liveTriangles[vertex] > 0) {
+            return vertex;
+        }
+    }
+    for (; cursor < liveTriangles.size(); cursor++) {
+        if (liveTriangles[cursor] > 0) {
+            return cursor;
+        }
+    }
+    return OPTIMIZE_NO_VERTEX;
+}
+
+// Tipsify on triangleCount triangles of indices, which only use vertices below
+// vertexCount. Writes the new triangle order, as positions into indices, to order.
+void tipsifyTriangles(u32 *indices, u32 triangleCount, u32 vertexCount, u32 *order) {
+    // triangles around each vertex, vertexTriangles[start[v]..start[v + 1]]
+    std::vector<u32> start(vertexCount + 1, 0);
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        start[indices[i] + 1]++;
+    }
+    for (u32 v = 0; v < vertexCount; v++) {
+        start[v + 1] += start[v];
+    }
+    std::vector<u32> vertexTriangles(triangleCount * 3);
+    std::vector<u32> fill(start.begin(), start.end() - 1);
+    for (u32 i = 0; i < triangleCount * 3; i++) {
+        vertexTriangles[fill[indices[i]]++] = i / 3;
+    }
+
+    std::vector<u32> liveTriangles(vertexCount);
+    for (u32 v = 0; v < vertexCount; v++) {
+        liveTriangles[v] = start[v + 1] - start[v];
+    }
+    std::vector<u32> cacheTime(vertexCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    std::vector<u32> deadEnds;
+    std::vector<u32> candidates;
+
+    u32 time = OPTIMIZE_CACHE_SIZE + 1;
+    u32 cursor = 0;
+    u32 emittedCount = 0;
+    u32 fan = triangleCount ? indices[0] : OPTIMIZE_NO_VERTEX;
+    while (fan != OPTIMIZE_NO_VERTEX) {
+        candidates.clear();
+        for (u32 i = start[fan]; i < start[fan + 1]; i++) {
+            u32 t = vertexTriangles[i];
+            if (emitted[t]) {
+                continue;
+            }
+            emitted[t] = true;
+            order[emittedCount++] = t;
+            for (int k = 0; k < 3; k++) {
+                u32 vertex = indices[t * 3 + k];
+                deadEnds.push_back(vertex);
+                candidates.push_back(vertex);
+                liveTriangles[vertex]--;
+                if (time - cacheTime[vertex] > OPTIMIZE_CACHE_SIZE) {
+                    cacheTime[vertex] = time++;
+                }
+            }
+        }
+        fan = getNextTipsifyVertex(candidates, liveTriangles, cacheTime, time, deadEnds, cursor);
+    }
+}
+
+// Reorders the triangles inside every meshlet for vertex locality. Meshlet ranges and
+// bounds stay as they are.
+void optimizeMeshletTriangles(Mesh &mesh) {
+    std::vector<u32> localOf(getMeshVertexCount(mesh), OPTIMIZE_NO_VERTEX);
+    std::vector<u32> localIndices;
+    std::vector<u32> order;
+    std::vector<u32> triangles;
+
+    for (int m = 0; m < mesh.meshlets.size(); m++) {
+        Meshlet &meshlet = mesh.meshlets[m];
+        u32 *indices = &mesh.indices[meshlet.firstTriangle * 3];
+        u32 cornerCount = meshlet.triangleCount * 3;
+
+        // numbered within the meshlet so the per vertex state stays small
+        u32 localCount = 0;
+        localIndices.resize(cornerCount);
+        for (u32 i = 0; i < cornerCount; i++) {
+            if (localOf[indices[i]] == OPTIMIZE_NO_VERTEX) {
+                localOf[indices[i]] = localCount++;
+            }
+            localIndices[i] = localOf[indices[i]];
+        }
+        for (u32 i = 0; i < cornerCount; i++) {
+            localOf[indices[i]] = OPTIMIZE_NO_VERTEX;
+        }
+
+        order.resize(meshlet.triangleCount);
+        tipsifyTriangles(&localIndices[0], meshlet.triangleCount, localCount, &order[0]);
+
+        triangles.assign(indices, indices + cornerCount);
+        for (u32 t = 0; t < meshlet.triangleCount; t++) {
+            for (int k = 0; k < 3; k++) {
+                indices[t * 3 + k] = triangles[order[t] * 3 + k];
+            }
+        }
+    }
+}
+
+// Sorts meshlets by how far out they sit along their own normal, measured from the
+// area weighted centroid of the mesh (Sander et al.). Clusters on the outside facing
+// outwards tend to be in front of the rest from whatever side the mesh is seen, so
+// drawing them first lets the depth test reject more of what follows.
+void optimizeMeshletOverdraw(Mesh &mesh) {
+    u32 triangleCount = getMeshTriangleCount(mesh);
+    glm::vec3 centroid(0);
+    float area = 0;
+    for (u32 t = 0; t < triangleCount; t++) {
+        glm::vec3 p0 = getMeshPosition(mesh, mesh.indices[t * 3]);
+        glm::vec3 p1 = getMeshPosition(mesh, mesh.indices[t * 3 + 1]);
+        glm::vec3 p2 = getMeshPosition(mesh, mesh.indices[t * 3 + 2]);
+        float triangleArea = glm::length(glm::cross(p1 - p0, p2 - p0));
+        centroid += (p0 + p1 + p2) * (triangleArea / 3);
+        area += triangleArea;
+    }
+    if (area > 0) {
+        centroid /= area;
+    }
+
+    std::vector<float> keys(mesh.meshlets.size());
+    std::vector<u32> sorted(mesh.meshlets.size());
+    for (int m = 0; m < mesh.meshlets.size(); m++) {
+        // coneAxis is zero when the normals cancel out, those go in the middle
+        keys[m] = glm::dot(mesh.meshlets[m].center - centroid, mesh.meshlets[m].coneAxis);
+        sorted[m] = m;
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [&](u32 a, u32 b) { return keys[a] > keys[b]; });
+
+    std::vector<u32> indices;
+    std::vector<Meshlet> meshlets;
+    indices.reserve(mesh.indices.size());
+    meshlets.reserve(mesh.meshlets.size());
+    for (int m = 0; m < sorted.size(); m++) {
+        Meshlet meshlet = mesh.meshlets[sorted[m]];
+        u32 *first = &mesh.indices[meshlet.firstTriangle * 3];
+        meshlet.firstTriangle = indices.size() / 3;
+        indices.insert(indices.end(), first, first + meshlet.triangleCount * 3);
+        meshlets.push_back(meshlet);
+    }
+    mesh.indices.swap(indices);
+    mesh.meshlets.swap(meshlets);
+}
+
+template <typename T> void remapStream(std::vector<T> &stream, std::vector<u32> &newIndexOf) {
+    std::vector<T> remapped(stream.size());
+    for (u32 i = 0; i < stream.size(); i++) {
+        remapped[newIndexOf[i]] = stream[i];
+    }
+    stream.swap(remapped);
+}
+
+// Renumbers the vertices in the order the index list first reaches them, so walking the
+// triangles walks every vertex stream front to back. Unused vertices are dropped.
+void optimizeVertexFetch(Mesh &mesh) {
+    u32 vertexCount = getMeshVertexCount(mesh);
+    std::vector<u32> newIndexOf(vertexCount, OPTIMIZE_NO_VERTEX);
+    u32 usedCount = 0;
+    for (u32 i = 0; i < mesh.indices.size(); i++) {
+        if (newIndexOf[mesh.indices[i]] == OPTIMIZE_NO_VERTEX) {
+            newIndexOf[mesh.indices[i]] = usedCount++;
+        }
+        mesh.indices[i] = newIndexOf[mesh.indices[i]];
+    }
+    u32 referencedCount = usedCount;
+    for (u32 v = 0; v < vertexCount; v++) {
+        if (newIndexOf[v] == OPTIMIZE_NO_VERTEX) {
+            newIndexOf[v] = usedCount++;
+        }
+    }
+
+    remapStream(mesh.positionX, newIndexOf);
+    remapStream(mesh.positionY, newIndexOf);
+    remapStream(mesh.positionZ, newIndexOf);
+    remapStream(mesh.normalX, newIndexOf);
+    remapStream(mesh.normalY, newIndexOf);
+    remapStream(mesh.normalZ, newIndexOf);
+    remapStream(mesh.u, newIndexOf);
+    remapStream(mesh.v, newIndexOf);
+
+    mesh.positionX.resize(referencedCount);
+    mesh.positionY.resize(referencedCount);
+    mesh.positionZ.resize(referencedCount);
+    mesh.normalX.resize(referencedCount);
+    mesh.normalY.resize(referencedCount);
+    mesh.normalZ.resize(referencedCount);
+    mesh.u.resize(referencedCount);
+    mesh.v.resize(referencedCount);
+}
+
+// Everything a freshly built index list goes through before it is drawn. Per triangle
+// streams have to be rebuilt afterwards.
+void optimizeMesh(Mesh &mesh) {
+    buildMeshlets(mesh);
+    optimizeMeshletTriangles(mesh);
+    optimizeMeshletOverdraw(mesh);
+    optimizeVertexFetch(mesh);
+}
+
+#endif // __OPTIMIZE_H__
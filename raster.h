@@ -0,0 +1,435 @@
+#ifndef __RASTER_H__
+#define __RASTER_H__
+
+#include "image.h"
+#include "types.h"
+#include <float.h>
+#include <glm/gtx/transform.hpp>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#include <immintrin.h>
+#define RASTER_X86 1
+#endif
+
+// Vertices are snapped to a 28.4 fixed point grid, 16 steps per pixel. Edge functions are
+// products of two such values and so carry 8 fractional bits.
+#define SUBPIXEL_BITS 4
+#define SUBPIXEL_SCALE (1 << SUBPIXEL_BITS)
+
+// Triangle setup for half-space rasterization. Edge function i is zero on the edge
+// opposite vertex i and equals twice the signed area at vertex i, so the three values
+// scaled by invArea are the barycentric weights of the pixel.
+//
+// Coverage is decided on the integer edge values only, which makes it exact: pixels on a
+// shared edge go to exactly one of the two triangles, whatever the compiler does with
+// floats. The float copies are only used to interpolate attributes.
+//
+// Samples sit on integer pixel coordinates, which is what glm::project with our
+// viewport produces.
+typedef struct TriangleSetup {
+    s64 edgeOrigin[3]; // at (minX, minY), minus one on edges that aren't top-left
+    s32 edgeStepX[3];
+    s32 edgeStepY[3];
+
+    glm::vec3 origin; // edge values at (minX, minY)
+    glm::vec3 stepX;
+    glm::vec3 stepY;
+    float invArea;
+
+    // depth plane, same values the barycentric weights give
+    float zOrigin;
+    float zStepX;
+    float zStepY;
+
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+} TriangleSetup;
+
+inline s32 toSubpixel(float v) { return s32(floorf(v * SUBPIXEL_SCALE + 0.5f)); }
+
+// Pixel centers inside the bounding box of a triangle's snapped vertices, the most it can
+// cover. Binning and the coarse depth test take their rects from here too, so they agree
+// with setupTriangle on every pixel.
+typedef struct PixelBounds {
+    int minX;
+    int minY;
+    int maxX;
+    int maxY;
+} PixelBounds;
+
+inline PixelBounds getSnappedPixelBounds(const s32 x[3], const s32 y[3]) {
+    PixelBounds bounds;
+    bounds.minX = (imin(imin(x[0], x[1]), x[2]) + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    bounds.minY = (imin(imin(y[0], y[1]), y[2]) + SUBPIXEL_SCALE - 1) >> SUBPIXEL_BITS;
+    bounds.maxX = imax(imax(x[0], x[1]), x[2]) >> SUBPIXEL_BITS;
+    bounds.maxY = imax(imax(y[0], y[1]), y[2]) >> SUBPIXEL_BITS;
+    return bounds;
+}
+
+inline PixelBounds getTrianglePixelBounds(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+    s32 x[3] = {toSubpixel(p0.x), toSubpixel(p1.x), toSubpixel(p2.x)};
+    s32 y[3] = {toSubpixel(p0.y), toSubpixel(p1.y), toSubpixel(p2.y)};
+    return getSnappedPixelBounds(x, y);
+}
+
+inline bool isTopLeftEdge(s32 ax, s32 ay, s32 bx, s32 by) {
+    return by < ay || (by == ay && bx < ax);
+}
+
+inline float getSignedArea(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+    return (p2.x - p1.x) * (p0.y - p1.y) - (p2.y - p1.y) * (p0.x - p1.x);
+}
+
+// Front faces are counter-clockwise in the OBJ files, they keep that winding in window
+// space.
+inline bool isBackFacing(glm::vec3 p0, glm::vec3 p1, glm::vec3 p2) {
+    return getSignedArea(p0, p1, p2) < 0;
+}
+
+// Returns false when nothing of the triangle lands in the clip rect or it is degenerate.
+bool setupTriangle(TriangleSetup *setup, glm::vec3 p0, glm::vec3 p1, glm::vec3 p2, int clipMinX,
+                   int clipMinY, int clipMaxX, int clipMaxY) {
+    s32 x[3] = {toSubpixel(p0.x), toSubpixel(p1.x), toSubpixel(p2.x)};
+    s32 y[3] = {toSubpixel(p0.y), toSubpixel(p1.y), toSubpixel(p2.y)};
+
+    s64 area = s64(x[2] - x[1]) * (y[0] - y[1]) - s64(y[2] - y[1]) * (x[0] - x[1]);
+    if (area == 0) {
+        return false;
+    }
+
+    // Both windings are drawn, flip clockwise triangles so the inside is always positive.
+    bool flipped = area < 0;
+    if (flipped) {
+        std::swap(x[1], x[2]);
+        std::swap(y[1], y[2]);
+        area = -area;
+    }
+
+    PixelBounds bounds = getSnappedPixelBounds(x, y);
+    setup->minX = imax(bounds.minX, clipMinX);
+    setup->minY = imax(bounds.minY, clipMinY);
+    setup->maxX = imin(bounds.maxX, clipMaxX);
+    setup->maxY = imin(bounds.maxY, clipMaxY);
+
+    if (setup->minX > setup->maxX || setup->minY > setup->maxY) {
+        return false;
+    }
+
+    s64 originX = s64(setup->minX) << SUBPIXEL_BITS;
+    s64 originY = s64(setup->minY) << SUBPIXEL_BITS;
+    for (int i = 0; i < 3; i++) {
+        int a = (i + 1) % 3;
+        int b = (i + 2) % 3;
+        s32 dx = y[a] - y[b];
+        s32 dy = x[b] - x[a];
+        s64 edge = dx * (originX - x[a]) + dy * (originY - y[a]);
+
+        setup->edgeOrigin[i] = edge - (isTopLeftEdge(x[a], y[a], x[b], y[b]) ? 0 : 1);
+        setup->edgeStepX[i] = dx * SUBPIXEL_SCALE;
+        setup->edgeStepY[i] = dy * SUBPIXEL_SCALE;
+
+        setup->origin[i] = float(edge);
+        setup->stepX[i] = float(setup->edgeStepX[i]);
+        setup->stepY[i] = float(setup->edgeStepY[i]);
+    }
+
+    setup->invArea = 1.0f / float(area);
+
+    // keep the weights in face order for flipped triangles
+    if (flipped) {
+        std::swap(setup->edgeOrigin[1], setup->edgeOrigin[2]);
+        std::swap(setup->edgeStepX[1], setup->edgeStepX[2]);
+        std::swap(setup->edgeStepY[1], setup->edgeStepY[2]);
+        std::swap(setup->origin[1], setup->origin[2]);
+        std::swap(setup->stepX[1], setup->stepX[2]);
+        std::swap(setup->stepY[1], setup->stepY[2]);
+    }
+
+    glm::vec3 depths(p0.z, p1.z, p2.z);
+    setup->zOrigin = glm::dot(depths, setup->origin * setup->invArea);
+    setup->zStepX = glm::dot(depths, setup->stepX * setup->invArea);
+    setup->zStepY = glm::dot(depths, setup->stepY * setup->invArea);
+
+    return true;
+}
+
+// One row of a triangle as the coverage kernels see it. The 64 bit edge values are
+// brought down to 32 bits: an edge that keeps its sign over the whole row is replaced
+// by a constant, the others are at most a row width of steps away from zero.
+typedef struct RowSetup {
+    s32 edges[3]; // a pixel is covered when all three are >= 0
+    s32 stepX[3];
+    float z;
+    float zStepX;
+} RowSetup;
+
+// Returns false when an edge excludes the whole row.
+inline bool getRowSetup(TriangleSetup &setup, int y, int count, RowSetup *row) {
+    s64 rowIndex = y - setup.minY;
+    for (int i = 0; i < 3; i++) {
+        s64 first = setup.edgeOrigin[i] + rowIndex * setup.edgeStepY[i];
+        s64 last = first + s64(count - 1) * setup.edgeStepX[i];
+        if (first < 0 && last < 0) {
+            return false;
+        }
+        if (first >= 0 && last >= 0) {
+            row->edges[i] = 0;
+            row->stepX[i] = 0;
+        } else {
+            row->edges[i] = s32(first);
+            row->stepX[i] = setup.edgeStepX[i];
+        }
+    }
+    row->z = setup.zOrigin + float(rowIndex) * setup.zStepY;
+    row->zStepX = setup.zStepX;
+    return true;
+}
+
+// Coverage + depth test for one row of a triangle, returned as a bit mask where bit i
+// stands for pixel minX + i. Rows never span more than a tile, so 64 bits are plenty.
+// Only pixels that are inside the triangle and closer than depthRow[i] are set, the
+// caller shades those and nothing else.
+//
+// All back ends produce exactly the same mask, the SIMD ones finish their rows here
+// starting at pixel first.
+u64 coverRowScalar(RowSetup &row, const float *depthRow, int first, int count) {
+    u64 mask = 0;
+    for (int i = first; i < count; i++) {
+        s32 e0 = row.edges[0] + i * row.stepX[0];
+        s32 e1 = row.edges[1] + i * row.stepX[1];
+        s32 e2 = row.edges[2] + i * row.stepX[2];
+        if ((e0 | e1 | e2) < 0)
+            continue;
+
+        float z = row.z + float(i) * row.zStepX;
+        if (depthRow[i] < z) {
+            mask |= u64(1) << i;
+        }
+    }
+    return mask;
+}
+
+#ifdef RASTER_X86
+
+// 4x1 pixel blocks, plain SSE2. The sign bits of the or-ed edge values are the outside
+// mask, so the coverage test is a single movemask.
+u64 coverRowSSE(RowSetup &row, const float *depthRow, int count) {
+    __m128i e0 = _mm_add_epi32(_mm_set1_epi32(row.edges[0]),
+                               _mm_set_epi32(3 * row.stepX[0], 2 * row.stepX[0], row.stepX[0], 0));
+    __m128i e1 = _mm_add_epi32(_mm_set1_epi32(row.edges[1]),
+                               _mm_set_epi32(3 * row.stepX[1], 2 * row.stepX[1], row.stepX[1], 0));
+    __m128i e2 = _mm_add_epi32(_mm_set1_epi32(row.edges[2]),
+                               _mm_set_epi32(3 * row.stepX[2], 2 * row.stepX[2], row.stepX[2], 0));
+
+    __m128i step0 = _mm_set1_epi32(row.stepX[0] * 4);
+    __m128i step1 = _mm_set1_epi32(row.stepX[1] * 4);
+    __m128i step2 = _mm_set1_epi32(row.stepX[2] * 4);
+
+    __m128 lane = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+    __m128 z0 = _mm_set1_ps(row.z);
+    __m128 zStep = _mm_set1_ps(row.zStepX);
+
+    u64 mask = 0;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i outside = _mm_or_si128(_mm_or_si128(e0, e1), e2);
+        int inside = ~_mm_movemask_ps(_mm_castsi128_ps(outside)) & 0xF;
+
+        if (inside) {
+            __m128 x = _mm_add_ps(_mm_set1_ps(float(i)), lane);
+            __m128 z = _mm_add_ps(z0, _mm_mul_ps(x, zStep));
+            __m128 closer = _mm_cmplt_ps(_mm_loadu_ps(depthRow + i), z);
+            mask |= u64(inside & _mm_movemask_ps(closer)) << i;
+        }
+
+        e0 = _mm_add_epi32(e0, step0);
+        e1 = _mm_add_epi32(e1, step1);
+        e2 = _mm_add_epi32(e2, step2);
+    }
+
+    // the last few pixels would read past the end of the depth row
+    if (i < count) {
+        mask |= coverRowScalar(row, depthRow, i, count);
+    }
+
+    return mask;
+}
+
+// Same as coverRowSSE with 8x1 blocks. Compiled for AVX2 regardless of the global flags
+// and only called when the CPU reports support for it. The end of the row goes through a
+// masked load instead of the scalar kernel, calling non-VEX code from here would pay for
+// the AVX to SSE transition on every row.
+__attribute__((target("avx2"))) u64 coverRowAVX2(RowSetup &row, const float *depthRow,
+                                                 int count) {
+    __m256i laneIndex = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    __m256i e0 = _mm256_add_epi32(_mm256_set1_epi32(row.edges[0]),
+                                  _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(row.stepX[0])));
+    __m256i e1 = _mm256_add_epi32(_mm256_set1_epi32(row.edges[1]),
+                                  _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(row.stepX[1])));
+    __m256i e2 = _mm256_add_epi32(_mm256_set1_epi32(row.edges[2]),
+                                  _mm256_mullo_epi32(laneIndex, _mm256_set1_epi32(row.stepX[2])));
+
+    __m256i step0 = _mm256_set1_epi32(row.stepX[0] * 8);
+    __m256i step1 = _mm256_set1_epi32(row.stepX[1] * 8);
+    __m256i step2 = _mm256_set1_epi32(row.stepX[2] * 8);
+
+    __m256 lane = _mm256_cvtepi32_ps(laneIndex);
+    __m256 z0 = _mm256_set1_ps(row.z);
+    __m256 zStep = _mm256_set1_ps(row.zStepX);
+
+    u64 mask = 0;
+    for (int i = 0; i < count; i += 8) {
+        __m256i outside = _mm256_or_si256(_mm256_or_si256(e0, e1), e2);
+        int inside = ~_mm256_movemask_ps(_mm256_castsi256_ps(outside)) & 0xFF;
+
+        int remaining = count - i;
+        if (remaining < 8) {
+            inside &= (1 << remaining) - 1;
+        }
+
+        if (inside) {
+            __m256 depths;
+            if (remaining < 8) {
+                __m256i valid = _mm256_cmpgt_epi32(_mm256_set1_epi32(remaining), laneIndex);
+                depths = _mm256_maskload_ps(depthRow + i, valid);
+            } else {
+                depths = _mm256_loadu_ps(depthRow + i);
+            }
+
+            __m256 x = _mm256_add_ps(_mm256_set1_ps(float(i)), lane);
+            __m256 z = _mm256_add_ps(z0, _mm256_mul_ps(x, zStep));
+            __m256 closer = _mm256_cmp_ps(depths, z, _CMP_LT_OQ);
+            mask |= u64(inside & _mm256_movemask_ps(closer)) << i;
+        }
+
+        e0 = _mm256_add_epi32(e0, step0);
+        e1 = _mm256_add_epi32(e1, step1);
+        e2 = _mm256_add_epi32(e2, step2);
+    }
+
+    return mask;
+}
+
+#endif // RASTER_X86
+
+#define COARSE_BLOCK_SIZE 8
+
+// Coarse depth level over a depth buffer, one value per 8x8 block. Larger z is closer in
+// our buffers, so the value kept is the smallest depth of the block: a triangle whose
+// nearest vertex isn't in front of it can't pass the depth test anywhere in the block.
+//
+// Blocks are refreshed lazily. Writing pixels into a block only marks it dirty and the
+// next query rescans its 64 depths, blocks a triangle covers without writing stay clean.
+// Blocks never straddle screen tiles, so a tile worker only ever touches its own blocks.
+typedef struct CoarseDepth {
+    float *depth;
+    int width;
+    int height;
+    int blocksX;
+    int blocksY;
+
+    std::vector<float> farthest;
+    std::vector<u8> dirty;
+} CoarseDepth;
+
+void resetCoarseDepth(CoarseDepth *coarse, float *depth, int width, int height) {
+    coarse->depth = depth;
+    coarse->width = width;
+    coarse->height = height;
+    coarse->blocksX = (width + COARSE_BLOCK_SIZE - 1) / COARSE_BLOCK_SIZE;
+    coarse->blocksY = (height + COARSE_BLOCK_SIZE - 1) / COARSE_BLOCK_SIZE;
+
+    // whatever is in the depth buffer already gets picked up on the first query
+    coarse->farthest.assign(coarse->blocksX * coarse->blocksY, 0.0f);
+    coarse->dirty.assign(coarse->blocksX * coarse->blocksY, 1);
+}
+
+float getCoarseBlockDepth(CoarseDepth *coarse, int blockX, int blockY) {
+    int block = blockX + blockY * coarse->blocksX;
+    if (!coarse->dirty[block]) {
+        return coarse->farthest[block];
+    }
+
+    int minX = blockX * COARSE_BLOCK_SIZE;
+    int minY = blockY * COARSE_BLOCK_SIZE;
+    int maxX = imin(minX + COARSE_BLOCK_SIZE, coarse->width);
+    int maxY = imin(minY + COARSE_BLOCK_SIZE, coarse->height);
+
+    float farthest = FLT_MAX;
+    for (int y = minY; y < maxY; y++) {
+        float *row = coarse->depth + y * coarse->width;
+        for (int x = minX; x < maxX; x++) {
+            farthest = fminf(farthest, row[x]);
+        }
+    }
+
+    coarse->farthest[block] = farthest;
+    coarse->dirty[block] = 0;
+    return farthest;
+}
+
+// True when a triangle covering at most the given pixel rect, with nearestZ as its
+// closest depth, is hidden in every block it touches.
+bool isOccludedCoarse(CoarseDepth *coarse, int minX, int minY, int maxX, int maxY,
+                      float nearestZ) {
+    for (int blockY = minY / COARSE_BLOCK_SIZE; blockY <= maxY / COARSE_BLOCK_SIZE; blockY++) {
+        for (int blockX = minX / COARSE_BLOCK_SIZE; blockX <= maxX / COARSE_BLOCK_SIZE;
+             blockX++) {
+            if (nearestZ > getCoarseBlockDepth(coarse, blockX, blockY)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Marks the blocks a row of written pixels lands in, mask as coverRow returns it for the
+// row y starting at minX.
+inline void markCoarseRowDirty(CoarseDepth *coarse, int minX, int y, u64 mask) {
+    u8 *dirty = &coarse->dirty[(y / COARSE_BLOCK_SIZE) * coarse->blocksX];
+    while (mask) {
+        int x = minX + __builtin_ctzll(mask);
+        dirty[x / COARSE_BLOCK_SIZE] = 1;
+        // skip the rest of that block
+        int next = (x / COARSE_BLOCK_SIZE + 1) * COARSE_BLOCK_SIZE - minX;
+        mask = next < 64 ? mask & (~0ull << next) : 0;
+    }
+}
+
+// Falls back to the widest back end the CPU actually has.
+RasterBackend getSupportedRasterBackend(RasterBackend requested) {
+#ifdef RASTER_X86
+    static bool hasAvx2 = __builtin_cpu_supports("avx2");
+    if (requested == RASTER_AVX2 && !hasAvx2) {
+        return RASTER_SSE;
+    }
+    return requested;
+#else
+    return RASTER_SCALAR;
+#endif
+}
+
+inline u64 coverRow(RasterBackend backend, TriangleSetup &setup, int y, const float *depthRow,
+                    int count) {
+    RowSetup row;
+    if (!getRowSetup(setup, y, count, &row)) {
+        return 0;
+    }
+
+#ifdef RASTER_X86
+    switch (backend) {
+    case RASTER_AVX2:
+        return coverRowAVX2(row, depthRow, count);
+    case RASTER_SSE:
+        return coverRowSSE(row, depthRow, count);
+    default:
+        break;
+    }
+#endif
+    return coverRowScalar(row, depthRow, 0, count);
+}
+
+#endif // __RASTER_H__
@@ -5,9 +5,15 @@
 #include <iostream>
 
 #include "app.h"
+#include "clip.h"
 #include "debug.h"
 #include "image.h"
+#include "jobs.h"
+#include "meshlet.h"
+#include "raster.h"
+#include "scenegraph.h"
 #include "types.h"
+#include "vertex.h"
 #include <GLFW/glfw3.h>
 #include <glm/gtx/matrix_decompose.hpp>
 #include <glm/gtx/string_cast.hpp>
@@ -29,16 +35,6 @@ void drawAxis(glm::mat4 view, glm::mat4 projection, glm::vec4 viewport, Image im
     drawLine(projectedOrigin, projectedzAxis, image, BLUE);
 }
 
-glm::mat4 getParentMatrix(Node *node) {
-    glm::mat4 matrix = glm::mat4(1);
-    Node *parentNode = node->parent;
-    if (!strcmp(parentNode->type, "transform")) {
-        Transform transform = *(Transform *)parentNode;
-        matrix = transform.matrix;
-    }
-    return matrix;
-}
-
 inline glm::mat4 getLightView(glm::vec3 lightDir) {
     return glm::lookAt(lightDir, glm::vec3(0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
 }
@@ -49,22 +45,83 @@ glm::mat4 getLightProjection() {
     return glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, nearPlane, farPlane);
 }
 
-typedef struct DefaultVertexShaderOut {
-    glm::vec3 position[3];
-    glm::vec3 normals[3];
-} DefaultVertexShaderOut;
+// At most 64 since coverRow returns one bit per pixel of a tile row, and a multiple of
+// COARSE_BLOCK_SIZE so coarse depth blocks stay inside a tile.
+#define TILE_SIZE 64
 
-typedef struct DefaultVertexShaderIn {
-    Face face;
+#define GBUFFER_EMPTY 0xFFFFFFFF
+
+// Deferred shading target for one screen tile, filled by runGBufferFragmentProgram and
+// shaded once the whole tile is rasterized.
+typedef struct GBufferTile {
+    u32 triangles[TILE_SIZE * TILE_SIZE];
+    glm::vec3 barycentrics[TILE_SIZE * TILE_SIZE];
+} GBufferTile;
+
+// Everything the shader programs need from a draw that does not change per triangle.
+// Built once per shape and pass by renderMeshInstances, the programs only hold a pointer
+// to it.
+typedef struct DrawUniforms {
     glm::mat4 model;
     glm::mat4 view;
     glm::mat4 projection;
+    glm::mat4 modelView;
+    glm::mat4 modelViewProjection;
+    glm::mat3 normalMatrix; // inverse transpose of modelView
+
+    glm::mat4 lightView;
+    glm::mat4 lightModelView;
+    glm::mat4 lightModelViewProjection;
+
     glm::vec4 viewport;
+} DrawUniforms;
+
+// Per vertex outputs of the vertex program, interpolated over the triangle for every
+// pixel. Only plain floats in here, interpolateVaryings walks the struct as an array.
+typedef struct Varyings {
+    glm::vec4 lightClipPosition; // divided per pixel, perspective doesn't survive the lerp
+    glm::vec2 uv;
+    glm::vec3 normal;
+} Varyings;
+
+#define VARYING_FLOAT_COUNT (sizeof(Varyings) / sizeof(float))
+
+// Screen space barycentrics to perspective correct ones, invW holds 1 / w per vertex.
+inline glm::vec3 getPerspectiveWeights(glm::vec3 barCoords, glm::vec3 invW) {
+    glm::vec3 weights = barCoords * invW;
+    return weights / (weights.x + weights.y + weights.z);
+}
+
+inline Varyings interpolateVaryings(Varyings **vertices, glm::vec3 weights) {
+    Varyings out;
+    float *result = (float *)&out;
+    float *v0 = (float *)vertices[0];
+    float *v1 = (float *)vertices[1];
+    float *v2 = (float *)vertices[2];
+    for (int i = 0; i < VARYING_FLOAT_COUNT; i++) {
+        result[i] = v0[i] * weights.x + v1[i] * weights.y + v2[i] * weights.z;
+    }
+    return out;
+}
+
+typedef struct DefaultVertexShaderOut {
+    glm::vec4 clipPosition;
+    Varyings varyings;
+} DefaultVertexShaderOut;
+
+typedef struct DefaultVertexShaderIn {
+    glm::vec3 position;
+    glm::vec2 uv;
+    glm::vec3 normal;
+    DrawUniforms *uniforms;
 } DefaultVertexShaderIn;
 
 typedef struct UberFragmentShaderIn {
     glm::vec3 *position;
-    Face face;
+    glm::vec3 invW;
+    Varyings *varyings[3];
+    glm::vec3 tangent;
+    glm::vec3 bitangent;
 
     u32 *buffer;
     u32 bufferWidth;
@@ -75,14 +132,25 @@ typedef struct UberFragmentShaderIn {
     Png normalMapTexture;
     Png specTexture;
     Png glowTexture;
+    TextureFilter textureFilter;
 
     glm::vec3 camPos;
-    glm::mat4 model;
-    glm::mat4 view;
-    glm::mat4 projection;
-    glm::vec4 viewport;
+    DrawUniforms *uniforms;
 
     Image image;
+
+    // inclusive pixel rect the program may write to, one screen tile
+    int tileMinX;
+    int tileMinY;
+    int tileMaxX;
+    int tileMaxY;
+
+    RasterBackend rasterBackend;
+    CoarseDepth *coarseDepth; // of the depth buffer this program writes
+
+    // deferred mode only
+    GBufferTile *gbuffer;
+    u32 triangleId;
 } UberFragmentShaderIn;
 
 typedef struct UberFragmentShaderOut {
@@ -91,247 +159,895 @@ typedef struct UberFragmentShaderOut {
 } UberFragmentShaderOut;
 
 DefaultVertexShaderOut runDefaultVertexProgram(DefaultVertexShaderIn in) {
-    glm::mat4 modelView = in.view * in.model;
+    DrawUniforms &uniforms = *in.uniforms;
 
     DefaultVertexShaderOut vertexOut;
 
-    for (int i = 0; i < 3; i++) {
-        glm::vec3 v0 = in.face.verts[i];
-        glm::vec4 vertex = glm::vec4(v0.x, v0.y, v0.z, 1);
+    glm::vec4 vertex = glm::vec4(in.position, 1);
+    vertexOut.clipPosition = uniforms.modelViewProjection * vertex;
+    vertexOut.varyings.lightClipPosition = uniforms.lightModelViewProjection * vertex;
+    vertexOut.varyings.uv = in.uv;
+    vertexOut.varyings.normal = in.normal;
 
-        glm::vec3 n0 = in.face.normals[i];
-        glm::vec4 normal = glm::vec4(n0.x, n0.y, n0.z, 1);
-        glm::mat4 normalModelMatrix = glm::transpose(glm::inverse(modelView));
-        glm::vec3 transformedNormal = glm::normalize(glm::vec3(normalModelMatrix * normal));
-        vertexOut.normals[i] = transformedNormal;
+    return vertexOut;
+}
 
-        vertexOut.position[i] =
-            glm::project(glm::vec3(vertex), modelView, in.projection, in.viewport);
+void runShadowFragmentProgram(UberFragmentShaderIn in) {
+    glm::vec3 p0 = in.position[0];
+    glm::vec3 p1 = in.position[1];
+    glm::vec3 p2 = in.position[2];
+
+    TriangleSetup setup;
+    if (!setupTriangle(&setup, p0, p1, p2, in.tileMinX, in.tileMinY, in.tileMaxX, in.tileMaxY)) {
+        return;
     }
 
-    return vertexOut;
+    glm::vec3 depths(p0.z, p1.z, p2.z);
+    int rowLength = setup.maxX - setup.minX + 1;
+
+    glm::vec3 rowEdges = setup.origin;
+    for (int y = setup.minY; y <= setup.maxY; y++, rowEdges += setup.stepY) {
+        float *depthRow = in.image.shadowbuffer + setup.minX + y * in.image.width;
+        u64 mask = coverRow(in.rasterBackend, setup, y, depthRow, rowLength);
+        markCoarseRowDirty(in.coarseDepth, setup.minX, y, mask);
+
+        glm::vec3 edges = rowEdges;
+        for (int x = setup.minX; mask; x++, mask >>= 1, edges += setup.stepX) {
+
+            if (!(mask & 1))
+                continue;
+
+            glm::vec3 barCoords = edges * setup.invArea;
+
+            glm::vec3 frag(x, y, glm::dot(depths, barCoords));
+
+            int coord = x + y * in.image.width;
+            in.image.shadowbuffer[coord] = frag.z;
+        }
+    }
 }
 
-glm::vec3 computeBarycentricCoords(glm::vec3 A, glm::vec3 B, glm::vec3 C, glm::vec3 P) {
-    glm::vec3 s[2];
-    for (int i = 2; i--;) {
-        s[i][0] = C[i] - A[i];
-        s[i][1] = B[i] - A[i];
-        s[i][2] = A[i] - P[i];
+// Values the uber shader derives from the triangle, shared by all its pixels.
+typedef struct UberTriangleConstants {
+    glm::vec3 T;
+    glm::vec3 B;
+
+    // change of the barycentrics from one pixel to the next, right and down
+    glm::vec3 barycentricStepX;
+    glm::vec3 barycentricStepY;
+} UberTriangleConstants;
+
+UberTriangleConstants setupUberTriangle(UberFragmentShaderIn &in) {
+    UberTriangleConstants constants;
+
+    constants.T = glm::normalize(in.uniforms->normalMatrix * in.tangent);
+    constants.B = glm::normalize(in.uniforms->normalMatrix * in.bitangent);
+
+    glm::vec3 p0 = in.position[0];
+    glm::vec3 p1 = in.position[1];
+    glm::vec3 p2 = in.position[2];
+    float area = (p1.x - p0.x) * (p2.y - p0.y) - (p1.y - p0.y) * (p2.x - p0.x);
+    float invArea = area != 0 ? 1 / area : 0;
+    constants.barycentricStepX = glm::vec3(p1.y - p2.y, p2.y - p0.y, p0.y - p1.y) * invArea;
+    constants.barycentricStepY = glm::vec3(p2.x - p1.x, p0.x - p2.x, p1.x - p0.x) * invArea;
+
+    return constants;
+}
+
+inline glm::vec2 interpolateUV(UberFragmentShaderIn &in, glm::vec3 barCoords) {
+    glm::vec3 weights = getPerspectiveWeights(barCoords, in.invW);
+    return in.varyings[0]->uv * weights.x + in.varyings[1]->uv * weights.y +
+           in.varyings[2]->uv * weights.z;
+}
+
+// UV derivatives of the 2x2 pixel quad frag is in, between its top left pixel and the
+// ones to the right of and below it, so the whole quad picks the same mip level. The
+// barycentrics are carried to those pixels along the plane of the triangle, whether the
+// pixels are covered or not.
+void getQuadUVDerivatives(UberFragmentShaderIn &in, UberTriangleConstants &constants,
+                          glm::vec3 frag, glm::vec3 barCoords, glm::vec2 *ddx, glm::vec2 *ddy) {
+    int x = int(frag.x);
+    int y = int(frag.y);
+    glm::vec3 quadCoords = barCoords - constants.barycentricStepX * float(x & 1) -
+                           constants.barycentricStepY * float(y & 1);
+    glm::vec2 uv = interpolateUV(in, quadCoords);
+    *ddx = interpolateUV(in, quadCoords + constants.barycentricStepX) - uv;
+    *ddy = interpolateUV(in, quadCoords + constants.barycentricStepY) - uv;
+}
+
+u32 shadeUberFragment(UberFragmentShaderIn &in, UberTriangleConstants &constants, glm::vec3 frag,
+                      glm::vec3 barCoords) {
+    Varyings varyings =
+        interpolateVaryings(in.varyings, getPerspectiveWeights(barCoords, in.invW));
+    glm::vec2 uv = varyings.uv;
+
+    glm::mat3 tangentSpace;
+
+    glm::vec3 N = glm::normalize(varyings.normal);
+
+    tangentSpace[0] = constants.T;
+    tangentSpace[1] = constants.B;
+    tangentSpace[2] = N;
+
+    glm::vec2 ddx(0), ddy(0);
+    if (in.textureFilter != TEXTURE_NEAREST) {
+        getQuadUVDerivatives(in, constants, frag, barCoords, &ddx, &ddy);
+    }
+    TextureSample sample = {.uv = uv, .ddx = ddx, .ddy = ddy, .filter = in.textureFilter};
+    TextureLookup lookup = {};
+
+    glm::vec3 textureNormal = sampleNormalTexture(sample, lookup, in.normalMapTexture);
+    glm::vec3 normal = glm::normalize(tangentSpace * textureNormal);
+    glm::vec3 glowColor = sampleTexture(sample, lookup, in.glowTexture) * glm::vec3(2);
+
+    float intensity = glm::dot(normal, glm::normalize(in.lightDir));
+    if (intensity < 0) {
+        intensity = 0;
     }
-    glm::vec3 u = cross(s[0], s[1]);
-    if (std::abs(u[2]) > 1e-2)
-        return glm::vec3(1.f - (u.x + u.y) / u.z, u.y / u.z, u.x / u.z);
-    return glm::vec3(-1, 1, 1);
+
+    glm::vec3 viewPos = in.camPos;
+    glm::vec3 viewDir = glm::normalize(viewPos - frag);
+    glm::vec3 halfwayDir = glm::normalize(in.lightDir + viewDir);
+
+    glm::vec3 diffuseColor = sampleTexture(sample, lookup, in.diffuseTexture);
+    float specWeight = sampleTexture(sample, lookup, in.specTexture)[0] / 255.0f;
+
+    float shininess = 40.0f;
+    float spec = pow(fmaxf(glm::dot(normal, halfwayDir), 0.0), shininess);
+
+    glm::vec3 lightColor = glm::vec3(255, 200, 200);
+
+    // shadow
+
+    // the shadow map is rendered with the same projection and viewport
+    glm::vec3 lightSpacePoint =
+        clipToViewport(varyings.lightClipPosition, in.uniforms->viewport);
+    lightSpacePoint.x = int(lightSpacePoint.x);
+    lightSpacePoint.y = int(lightSpacePoint.y);
+
+    int idx = lightSpacePoint.x + in.image.width * lightSpacePoint.y;
+    float shadow = 0.3 + .7 * (in.image.shadowbuffer[idx] - 0.000005 < lightSpacePoint.z); //
+
+    glm::vec3 color =
+        glowColor + (diffuseColor + lightColor * spec * specWeight) * intensity * shadow;
+    //
+    u8 rsrgb = u8(linearToSrgb(fminf(color.r, 255) / 255.0f) * 255);
+    u8 gsrgb = u8(linearToSrgb(fminf(color.g, 255) / 255.0f) * 255);
+    u8 bsrgb = u8(linearToSrgb(fminf(color.b, 255) / 255.0f) * 255);
+
+    return rgbToU32(rsrgb, gsrgb, bsrgb);
 }
 
-void runShadowFragmentProgram(UberFragmentShaderIn in) {
+void runUberFragmentProgram(UberFragmentShaderIn in) {
     glm::vec3 p0 = in.position[0];
     glm::vec3 p1 = in.position[1];
     glm::vec3 p2 = in.position[2];
 
-    int minX = imin(imin(imin(p0.x, p1.x), p2.x), in.bufferWidth - 1);
-    int maxX = imax(imax(imax(p0.x, p1.x), p2.x), 0);
+    TriangleSetup setup;
+    if (!setupTriangle(&setup, p0, p1, p2, in.tileMinX, in.tileMinY, in.tileMaxX, in.tileMaxY)) {
+        return;
+    }
 
-    int minY = imin(imin(imin(p0.y, p1.y), p2.y), in.bufferHeight - 1);
-    int maxY = imax(imax(imax(p0.y, p1.y), p2.y), 0);
+    UberTriangleConstants constants = setupUberTriangle(in);
 
-    glm::vec3 frag;
+    glm::vec3 depths(p0.z, p1.z, p2.z);
+    int rowLength = setup.maxX - setup.minX + 1;
 
-    for (frag.x = minX; frag.x <= maxX; frag.x++) {
-        for (frag.y = minY; frag.y <= maxY; frag.y++) {
+    glm::vec3 rowEdges = setup.origin;
+    for (int y = setup.minY; y <= setup.maxY; y++, rowEdges += setup.stepY) {
+        float *depthRow = in.image.zbuffer + setup.minX + y * in.image.width;
+        u64 mask = coverRow(in.rasterBackend, setup, y, depthRow, rowLength);
+        markCoarseRowDirty(in.coarseDepth, setup.minX, y, mask);
 
-            glm::vec3 barCoords = computeBarycentricCoords(p0, p1, p2, frag);
+        glm::vec3 edges = rowEdges;
+        for (int x = setup.minX; mask; x++, mask >>= 1, edges += setup.stepX) {
 
-            if (barCoords.x < 0 || barCoords.y < 0 || barCoords.z < 0)
+            if (!(mask & 1))
                 continue;
 
-            frag.z = 0;
-            frag.z += p0.z * barCoords[0];
-            frag.z += p1.z * barCoords[1];
-            frag.z += p2.z * barCoords[2];
+            glm::vec3 barCoords = edges * setup.invArea;
+
+            glm::vec3 frag(x, y, glm::dot(depths, barCoords));
+
+            u32 color_out = shadeUberFragment(in, constants, frag, barCoords);
 
-            int coord = int(frag.x + frag.y * in.image.width);
-            if (in.image.shadowbuffer[coord] < frag.z) {
-                in.image.shadowbuffer[coord] = frag.z;
+            int coord = x + y * in.image.width;
+            bool shouldRender = boundsCheck(x, y, in.image.width, in.image.height);
+            if (shouldRender) {
+                in.image.zbuffer[coord] = frag.z;
+                in.image.buffer[coord] = color_out;
             }
         }
     }
 }
 
-void runUberFragmentProgram(UberFragmentShaderIn in) {
+// Geometry pass of the deferred mode. Only depth and what is needed to find the surface
+// again are written: the triangle and its barycentrics. UVs, normals and the tangent
+// frame are rebuilt from those when the pixel is shaded.
+void runGBufferFragmentProgram(UberFragmentShaderIn in) {
     glm::vec3 p0 = in.position[0];
     glm::vec3 p1 = in.position[1];
     glm::vec3 p2 = in.position[2];
 
-    int minX = imin(imin(imin(p0.x, p1.x), p2.x), in.bufferWidth - 1);
-    int maxX = imax(imax(imax(p0.x, p1.x), p2.x), 0);
+    TriangleSetup setup;
+    if (!setupTriangle(&setup, p0, p1, p2, in.tileMinX, in.tileMinY, in.tileMaxX, in.tileMaxY)) {
+        return;
+    }
 
-    int minY = imin(imin(imin(p0.y, p1.y), p2.y), in.bufferHeight - 1);
-    int maxY = imax(imax(imax(p0.y, p1.y), p2.y), 0);
+    glm::vec3 depths(p0.z, p1.z, p2.z);
+    int rowLength = setup.maxX - setup.minX + 1;
 
-    glm::vec3 frag;
+    glm::vec3 rowEdges = setup.origin;
+    for (int y = setup.minY; y <= setup.maxY; y++, rowEdges += setup.stepY) {
+        float *depthRow = in.image.zbuffer + setup.minX + y * in.image.width;
+        u64 mask = coverRow(in.rasterBackend, setup, y, depthRow, rowLength);
+        markCoarseRowDirty(in.coarseDepth, setup.minX, y, mask);
 
-    glm::mat4 modelView = in.view * in.model;
-    glm::mat3 modelVector = glm::transpose(glm::inverse(glm::mat3(modelView)));
+        glm::vec3 edges = rowEdges;
+        for (int x = setup.minX; mask; x++, mask >>= 1, edges += setup.stepX) {
 
-    glm::vec3 T = glm::normalize(modelVector * in.face.tangent);
-    glm::vec3 B = glm::normalize(modelVector * in.face.bitangent);
+            if (!(mask & 1))
+                continue;
 
-    glm::mat4 lightView = getLightView(in.lightDir);
-    glm::mat4 lightModelView = lightView * in.model;
+            glm::vec3 barCoords = edges * setup.invArea;
 
-    u32 textureWidth = in.diffuseTexture.width; // all of them are the same
-    u32 textureHeight = in.diffuseTexture.height;
+            glm::vec3 frag(x, y, glm::dot(depths, barCoords));
 
-    for (frag.x = minX; frag.x <= maxX; frag.x++) {
-        for (frag.y = minY; frag.y <= maxY; frag.y++) {
+            int coord = x + y * in.image.width;
+            bool shouldRender = boundsCheck(x, y, in.image.width, in.image.height);
+            if (shouldRender) {
+                int texel = x - in.tileMinX + (y - in.tileMinY) * TILE_SIZE;
+                in.image.zbuffer[coord] = frag.z;
+                in.gbuffer->triangles[texel] = in.triangleId;
+                in.gbuffer->barycentrics[texel] = barCoords;
+            }
+        }
+    }
+}
 
-            glm::vec3 barCoords = computeBarycentricCoords(p0, p1, p2, frag);
+#define VERTEX_JOB_SIZE 1024
+#define MESHLET_JOB_SIZE (VERTEX_JOB_SIZE / MESHLET_MAX_TRIANGLES)
+#define INSTANCE_BATCH_VERTICES (16 * VERTEX_JOB_SIZE)
+
+typedef void (*FragmentCallback)(UberFragmentShaderIn);
+
+typedef struct DrawCall {
+    Shape *shape;
+    Mesh *mesh; // the resource's mesh or one of its LODs
+    DrawUniforms uniforms;
+    float zNear;
+    bool cullBackFaces;
+    FragmentCallback fragmentCallback;
+
+    // where the draw starts in TileBins::vertices and TileBins::triangles
+    u32 firstVertex;
+    u32 firstTriangle;
+} DrawCall;
+
+enum TriangleClipState {
+    TRIANGLE_INSIDE,   // fully inside the guard band, drawn as is
+    TRIANGLE_OUTSIDE,  // outside one of the clip planes, dropped
+    TRIANGLE_CROSSING, // needs clipping before it can be binned
+    TRIANGLE_CLIPPED   // piece of a clipped triangle, same face with its own varyings
+};
+
+// Output of the vertex stage, one per mesh vertex of a draw plus the corners added by
+// clipping. The varyings live in TileBins::varyings at the same index.
+typedef struct TransformedVertex {
+    glm::vec4 clipPosition;
+    glm::vec3 position; // window coordinates, meaningless unless clipCode is 0
+    float invW;
+    u32 clipCode;
+} TransformedVertex;
+
+typedef struct BinnedTriangle {
+    glm::vec3 position[3];
+    glm::vec3 invW;
+    u32 vertices[3]; // into TileBins::vertices
+    u32 drawIndex;
+    u32 faceIndex;
+    TriangleClipState clipState;
+} BinnedTriangle;
+
+typedef struct VisibleMeshlet {
+    u32 drawIndex;
+    u32 meshlet;
+} VisibleMeshlet;
+
+// Post-transform triangles sorted into screen tiles. Every tile is rasterized by exactly
+// one worker and in submission order, so the z-buffer needs no locking and the result is
+// the same as drawing the triangles one after another.
+typedef struct TileBins {
+    int width;
+    int height;
+    int tilesX;
+    int tilesY;
+
+    std::vector<DrawCall> draws;
+    std::vector<TransformedVertex> vertices;
+    std::vector<Varyings> varyings;
+    std::vector<BinnedTriangle> triangles;
+    std::vector<std::vector<u32> > tiles;
+    std::vector<u32> activeTiles;
+    std::vector<VisibleMeshlet> meshlets; // of the draws being set up, survived culling
+
+    CoarseDepth coarseDepth;
+
+    // shade through a per tile G-buffer once all triangles of the tile are drawn
+    bool deferred;
+} TileBins;
+
+void beginTileBins(TileBins *bins, int width, int height, float *depth) {
+    bins->width = width;
+    bins->height = height;
+    bins->tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    bins->tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+
+    // clear() keeps the capacity around, after the first frame binning doesn't allocate
+    bins->tiles.resize(bins->tilesX * bins->tilesY);
+    for (int i = 0; i < bins->tiles.size(); i++) {
+        bins->tiles[i].clear();
+    }
+    bins->draws.clear();
+    bins->vertices.clear();
+    bins->varyings.clear();
+    bins->triangles.clear();
+    bins->activeTiles.clear();
+
+    resetCoarseDepth(&bins->coarseDepth, depth, width, height);
+    bins->deferred = false;
+}
 
-            if (barCoords.x < 0 || barCoords.y < 0 || barCoords.z < 0)
-                continue;
+void binTriangle(TileBins *bins, u32 triangleIndex) {
+    glm::vec3 p0 = bins->triangles[triangleIndex].position[0];
+    glm::vec3 p1 = bins->triangles[triangleIndex].position[1];
+    glm::vec3 p2 = bins->triangles[triangleIndex].position[2];
+    PixelBounds bounds = getTrianglePixelBounds(p0, p1, p2);
 
-            frag.z = 0;
-            frag.z += p0.z * barCoords[0];
-            frag.z += p1.z * barCoords[1];
-            frag.z += p2.z * barCoords[2];
+    int minX = imax(bounds.minX, 0);
+    int maxX = imin(bounds.maxX, bins->width - 1);
 
-            glm::vec3 uv = toBarycentric(barCoords, in.face.uvs);
-            glm::vec3 barycentricNormal = toBarycentric(barCoords, in.face.normals);
+    int minY = imax(bounds.minY, 0);
+    int maxY = imin(bounds.maxY, bins->height - 1);
 
-            glm::mat3 tangentSpace;
-            glm::vec3 edge1 = p1 - p0;
-            glm::vec3 edge2 = p2 - p0;
+    if (minX > maxX || minY > maxY) {
+        return;
+    }
 
-            glm::vec3 N = glm::normalize(barycentricNormal);
+    for (int tileY = minY / TILE_SIZE; tileY <= maxY / TILE_SIZE; tileY++) {
+        for (int tileX = minX / TILE_SIZE; tileX <= maxX / TILE_SIZE; tileX++) {
+            bins->tiles[tileX + tileY * bins->tilesX].push_back(triangleIndex);
+        }
+    }
+}
 
-            tangentSpace[0] = T;
-            tangentSpace[1] = B;
-            tangentSpace[2] = N;
+// Vertex and triangle setup for a run of draws of the same mesh, jobsPerDraw vertex jobs
+// for each.
+typedef struct VertexJob {
+    TileBins *bins;
+    u32 firstDraw;
+    int jobsPerDraw;
+    RasterBackend backend;
+} VertexJob;
+
+inline TransformedVertex getTransformedVertex(glm::vec4 clipPosition, DrawCall &draw) {
+    TransformedVertex vertex;
+    vertex.clipPosition = clipPosition;
+    vertex.position = clipToViewport(clipPosition, draw.uniforms.viewport);
+    vertex.invW = 1.0f / clipPosition.w;
+    vertex.clipCode = getClipCode(clipPosition, draw.zNear);
+    return vertex;
+}
 
-            u32 x = textureWidth * uv.x;
-            u32 y = textureHeight * uv.y;
+// Runs the vertex program once for every vertex of the mesh. The SIMD back ends do the
+// positions a batch at a time, the scalar one and the leftovers of a job go through the
+// vertex program vertex by vertex.
+void runVertexJob(void *userdata, int jobIndex) {
+    VertexJob *job = (VertexJob *)userdata;
+    DrawCall &draw = job->bins->draws[job->firstDraw + jobIndex / job->jobsPerDraw];
+    Mesh &mesh = *draw.mesh;
+
+    int first = (jobIndex % job->jobsPerDraw) * VERTEX_JOB_SIZE;
+    int last = imin(first + VERTEX_JOB_SIZE, getMeshVertexCount(mesh));
+
+    // every attribute comes from its own stream, each read front to back
+    float *positionX = mesh.positionX.data();
+    float *positionY = mesh.positionY.data();
+    float *positionZ = mesh.positionZ.data();
+    float *normalX = mesh.normalX.data();
+    float *normalY = mesh.normalY.data();
+    float *normalZ = mesh.normalZ.data();
+    float *u = mesh.u.data();
+    float *v = mesh.v.data();
+
+    TransformedVertex *vertices = &job->bins->vertices[draw.firstVertex];
+    Varyings *varyings = &job->bins->varyings[draw.firstVertex];
+
+    VertexTransform transform = {.clipMatrix = draw.uniforms.modelViewProjection,
+                                 .lightMatrix = draw.uniforms.lightModelViewProjection,
+                                 .viewport = draw.uniforms.viewport,
+                                 .zNear = draw.zNear};
+    VertexBatch batch;
+
+    int i = first;
+    for (; i + VERTEX_BATCH_SIZE <= last; i += VERTEX_BATCH_SIZE) {
+        if (!transformVertices(job->backend, transform, positionX + i, positionY + i,
+                               positionZ + i, &batch)) {
+            break;
+        }
 
-            u32 offset = (y * textureWidth + x) * 4;
+        for (int k = 0; k < VERTEX_BATCH_SIZE; k++) {
+            TransformedVertex &vertex = vertices[i + k];
+            vertex.clipPosition =
+                glm::vec4(batch.clipX[k], batch.clipY[k], batch.clipZ[k], batch.clipW[k]);
+            vertex.position = glm::vec3(batch.screenX[k], batch.screenY[k], batch.screenZ[k]);
+            vertex.invW = batch.invW[k];
+            vertex.clipCode = batch.clipCode[k];
+
+            varyings[i + k].lightClipPosition =
+                glm::vec4(batch.lightX[k], batch.lightY[k], batch.lightZ[k], batch.lightW[k]);
+            varyings[i + k].uv = glm::vec2(u[i + k], v[i + k]);
+            varyings[i + k].normal = glm::vec3(normalX[i + k], normalY[i + k], normalZ[i + k]);
+        }
+    }
 
-            glm::vec3 textureNormal = sampleNormalTexture(offset, in.normalMapTexture);
-            glm::vec3 normal = glm::normalize(tangentSpace * textureNormal);
-            glm::vec3 glowColor = sampleTexture(offset, in.glowTexture) * glm::vec3(2);
+    for (; i < last; i++) {
+        DefaultVertexShaderIn vertexIn = {
+            .position = glm::vec3(positionX[i], positionY[i], positionZ[i]),
+            .uv = glm::vec2(u[i], v[i]),
+            .normal = glm::vec3(normalX[i], normalY[i], normalZ[i]),
+            .uniforms = &draw.uniforms};
 
-            float intensity = glm::dot(normal, glm::normalize(in.lightDir));
-            if (intensity < 0) {
-                intensity = 0;
-            }
+        DefaultVertexShaderOut vertexOut = runDefaultVertexProgram(vertexIn);
+
+        vertices[i] = getTransformedVertex(vertexOut.clipPosition, draw);
+        varyings[i] = vertexOut.varyings;
+    }
+}
+
+// Fills in triangle i of the draw's mesh, still in clip space unless it is fully inside.
+void setupBinnedTriangle(TileBins *bins, u32 drawIndex, u32 i) {
+    DrawCall &draw = bins->draws[drawIndex];
+    std::vector<u32> &indices = draw.mesh->indices;
+
+    BinnedTriangle &triangle = bins->triangles[draw.firstTriangle + i];
+    triangle.drawIndex = drawIndex;
+    triangle.faceIndex = i;
 
-            glm::vec3 viewPos = in.camPos;
-            glm::vec3 viewDir = glm::normalize(viewPos - frag);
-            glm::vec3 halfwayDir = glm::normalize(in.lightDir + viewDir);
+    TransformedVertex *corners[3];
+    for (int k = 0; k < 3; k++) {
+        triangle.vertices[k] = draw.firstVertex + indices[i * 3 + k];
+        corners[k] = &bins->vertices[triangle.vertices[k]];
+    }
 
-            glm::vec3 diffuseColor = sampleTexture(offset, in.diffuseTexture);
-            float specWeight = sampleTexture(offset, in.specTexture)[0] / 255.0f;
+    u32 code0 = corners[0]->clipCode;
+    u32 code1 = corners[1]->clipCode;
+    u32 code2 = corners[2]->clipCode;
+
+    if (code0 & code1 & code2) {
+        triangle.clipState = TRIANGLE_OUTSIDE;
+    } else if (code0 | code1 | code2) {
+        // rare, clipped on the calling thread since it can produce extra triangles
+        triangle.clipState = TRIANGLE_CROSSING;
+    } else {
+        triangle.clipState = TRIANGLE_INSIDE;
+        for (int k = 0; k < 3; k++) {
+            triangle.position[k] = corners[k]->position;
+            triangle.invW[k] = corners[k]->invW;
+        }
+        if (draw.cullBackFaces &&
+            isBackFacing(triangle.position[0], triangle.position[1], triangle.position[2])) {
+            triangle.clipState = TRIANGLE_OUTSIDE;
+        }
+    }
+}
 
-            float shininess = 40.0f;
-            float spec = pow(fmaxf(glm::dot(normal, halfwayDir), 0.0), shininess);
+// Gathers the transformed corners of every triangle in the visible meshlets of the job
+// and decides what to do with it.
+void runTriangleJob(void *userdata, int jobIndex) {
+    VertexJob *job = (VertexJob *)userdata;
 
-            glm::vec3 lightColor = glm::vec3(255, 200, 200);
+    int firstMeshlet = jobIndex * MESHLET_JOB_SIZE;
+    int lastMeshlet = imin(firstMeshlet + MESHLET_JOB_SIZE, job->bins->meshlets.size());
 
-            // shadow
+    for (int m = firstMeshlet; m < lastMeshlet; m++) {
+        VisibleMeshlet visible = job->bins->meshlets[m];
+        Meshlet &meshlet = job->bins->draws[visible.drawIndex].mesh->meshlets[visible.meshlet];
+        for (u32 i = meshlet.firstTriangle; i < meshlet.firstTriangle + meshlet.triangleCount;
+             i++) {
+            setupBinnedTriangle(job->bins, visible.drawIndex, i);
+        }
+    }
+}
 
-            glm::vec3 originalPoint = glm::unProject(frag, modelView, in.projection, in.viewport);
-            glm::vec3 lightSpacePoint =
-                glm::project(glm::vec3(originalPoint), lightModelView, in.projection, in.viewport);
-            lightSpacePoint.x = int(lightSpacePoint.x);
-            lightSpacePoint.y = int(lightSpacePoint.y);
+// Replaces the crossing triangle by the fan of triangles left after clipping. The corners
+// of the clipped polygon become new vertices with their varyings interpolated.
+void clipCrossingTriangle(TileBins *bins, u32 triangleIndex) {
+    BinnedTriangle triangle = bins->triangles[triangleIndex];
+    DrawCall &draw = bins->draws[triangle.drawIndex];
+
+    glm::vec4 positions[3];
+    Varyings varyings[3];
+    u32 planes = 0;
+    for (int k = 0; k < 3; k++) {
+        positions[k] = bins->vertices[triangle.vertices[k]].clipPosition;
+        varyings[k] = bins->varyings[triangle.vertices[k]];
+        planes |= bins->vertices[triangle.vertices[k]].clipCode;
+    }
+    Varyings *corners[3] = {&varyings[0], &varyings[1], &varyings[2]};
 
-            int idx = lightSpacePoint.x + in.image.width * lightSpacePoint.y;
-            float shadow =
-                0.3 + .7 * (in.image.shadowbuffer[idx] - 0.000005 < lightSpacePoint.z); //
+    ClipVertex polygon[CLIP_MAX_VERTICES];
+    int count = clipTriangle(positions, planes, draw.zNear, polygon);
 
-            glm::vec3 color = glowColor +
-                              (diffuseColor + lightColor * spec * specWeight) * intensity * shadow;
-            //
-            u8 rsrgb = u8(linearToSrgb(fminf(color.r, 255) / 255.0f) * 255);
-            u8 gsrgb = u8(linearToSrgb(fminf(color.g, 255) / 255.0f) * 255);
-            u8 bsrgb = u8(linearToSrgb(fminf(color.b, 255) / 255.0f) * 255);
+    u32 firstCorner = bins->vertices.size();
+    for (int i = 0; i < count; i++) {
+        bins->vertices.push_back(getTransformedVertex(polygon[i].position, draw));
+        // clip space is where attributes are linear, so no perspective fix here
+        bins->varyings.push_back(interpolateVaryings(corners, polygon[i].barycentric));
+    }
 
-            u32 color_out = rgbToU32(rsrgb, gsrgb, bsrgb);
+    for (int i = 1; i + 1 < count; i++) {
+        BinnedTriangle clipped;
+        clipped.vertices[0] = firstCorner;
+        clipped.vertices[1] = firstCorner + i;
+        clipped.vertices[2] = firstCorner + i + 1;
+        for (int k = 0; k < 3; k++) {
+            TransformedVertex &vertex = bins->vertices[clipped.vertices[k]];
+            clipped.position[k] = vertex.position;
+            clipped.invW[k] = vertex.invW;
+        }
 
-            int coord = int(frag.x + frag.y * in.image.width);
-            if (in.image.zbuffer[coord] < frag.z) {
-                bool shouldRender = boundsCheck(frag.x, frag.y, in.image.width, in.image.height);
-                if (shouldRender) {
-                    in.image.zbuffer[coord] = frag.z;
-                    in.image.buffer[coord] = color_out;
-                }
+        if (draw.cullBackFaces &&
+            isBackFacing(clipped.position[0], clipped.position[1], clipped.position[2])) {
+            continue;
+        }
+
+        clipped.drawIndex = triangle.drawIndex;
+        clipped.faceIndex = triangle.faceIndex;
+        clipped.clipState = TRIANGLE_CLIPPED;
+        bins->triangles.push_back(clipped);
+        binTriangle(bins, bins->triangles.size() - 1);
+    }
+}
+
+glm::mat4 getShapeModelMatrix(Shape *shape, App *app) {
+    glm::mat4 rotation = glm::rotate(glm::radians(app->rotateY), glm::vec3(0, 1, 0));
+    return app->world->world[shape->node] * rotation;
+}
+
+DrawUniforms getDrawUniforms(glm::mat4 model, glm::mat4 view, glm::mat4 projection,
+                             glm::vec4 viewport, glm::vec3 lightDir) {
+    DrawUniforms uniforms;
+    uniforms.model = model;
+    uniforms.view = view;
+    uniforms.projection = projection;
+    uniforms.modelView = view * model;
+    uniforms.modelViewProjection = projection * uniforms.modelView;
+    uniforms.normalMatrix = glm::transpose(glm::inverse(glm::mat3(uniforms.modelView)));
+
+    uniforms.lightView = getLightView(lightDir);
+    uniforms.lightModelView = uniforms.lightView * model;
+    uniforms.lightModelViewProjection = projection * uniforms.lightModelView;
+
+    uniforms.viewport = viewport;
+    return uniforms;
+}
+
+// A shape that survived frustum culling, with the mesh picked for it.
+typedef struct ShapeInstance {
+    Shape *shape;
+    Mesh *mesh;
+    glm::mat4 model;
+} ShapeInstance;
+
+// Sets up one draw per instance, all of the same mesh. The draws go through the vertex
+// and triangle stages together, so a field of small copies shares two job dispatches
+// instead of paying for two each.
+void renderMeshInstances(Mesh *mesh, ShapeInstance *instances, int instanceCount,
+                         glm::mat4 projection, glm::mat4 view, glm::vec4 viewport, App *app,
+                         FragmentCallback fragmentCallback, TileBins *bins) {
+    u32 vertexCount = getMeshVertexCount(*mesh);
+    u32 triangleCount = getMeshTriangleCount(*mesh);
+    u32 firstDraw = bins->draws.size();
+    bins->meshlets.clear();
+
+    for (int n = 0; n < instanceCount; n++) {
+        ShapeInstance &instance = instances[n];
+        DrawCall draw = {
+            .shape = instance.shape,
+            .mesh = mesh,
+            .uniforms = getDrawUniforms(instance.model, view, projection, viewport, app->lightDir),
+            .zNear = app->camera.zNear,
+            .cullBackFaces = !instance.shape->doubleSided,
+            .fragmentCallback = fragmentCallback,
+            .firstVertex = u32(bins->vertices.size() + n * vertexCount),
+            .firstTriangle = u32(bins->triangles.size() + n * triangleCount)};
+        bins->draws.push_back(draw);
+
+        // whole clusters go before any per triangle work, both tests in object space
+        glm::vec4 planes[CLIP_PLANE_COUNT];
+        getFrustumPlanes(draw.uniforms.modelViewProjection, draw.zNear, planes);
+        glm::vec3 eye = glm::vec3(glm::inverse(draw.uniforms.modelView)[3]);
+        for (u32 i = 0; i < mesh->meshlets.size(); i++) {
+            if (!isMeshletCulled(mesh->meshlets[i], planes, eye, draw.cullBackFaces)) {
+                VisibleMeshlet visible = {.drawIndex = firstDraw + n, .meshlet = i};
+                bins->meshlets.push_back(visible);
+            }
+        }
+    }
+
+    bins->vertices.resize(bins->vertices.size() + instanceCount * vertexCount);
+    bins->varyings.resize(bins->varyings.size() + instanceCount * vertexCount);
+    bins->triangles.resize(bins->triangles.size() + instanceCount * triangleCount);
+
+    VertexJob job = {.bins = bins,
+                     .firstDraw = firstDraw,
+                     .jobsPerDraw = int((vertexCount + VERTEX_JOB_SIZE - 1) / VERTEX_JOB_SIZE),
+                     .backend = getSupportedRasterBackend(app->rasterBackend)};
+    runJobs(app->jobs, runVertexJob, &job, job.jobsPerDraw * instanceCount);
+    runJobs(app->jobs, runTriangleJob, &job,
+            (bins->meshlets.size() + MESHLET_JOB_SIZE - 1) / MESHLET_JOB_SIZE);
+
+    // in draw order, then triangle order, same as drawing the instances one by one
+    for (int m = 0; m < bins->meshlets.size(); m++) {
+        VisibleMeshlet visible = bins->meshlets[m];
+        Meshlet &meshlet = mesh->meshlets[visible.meshlet];
+        u32 first = bins->draws[visible.drawIndex].firstTriangle + meshlet.firstTriangle;
+        for (u32 i = first; i < first + meshlet.triangleCount; i++) {
+            switch (bins->triangles[i].clipState) {
+            case TRIANGLE_INSIDE:
+                binTriangle(bins, i);
+                break;
+            case TRIANGLE_CROSSING:
+                clipCrossingTriangle(bins, i);
+                break;
+            default:
+                break;
             }
         }
     }
 }
 
-void renderShape(Shape *shape, glm::mat4 projection, glm::mat4 view, glm::vec4 viewport, App *app,
-                 void (*fragmentCallback)(UberFragmentShaderIn)) {
+typedef struct TileJob {
+    TileBins *bins;
+    App *app;
+} TileJob;
+
+UberFragmentShaderIn getTileFragmentShaderIn(TileBins *bins, App *app, u32 triangleId,
+                                             int tileMinX, int tileMinY, int tileMaxX,
+                                             int tileMaxY, GBufferTile *gbuffer) {
+    BinnedTriangle &triangle = bins->triangles[triangleId];
+    DrawCall &draw = bins->draws[triangle.drawIndex];
+
+    Mesh &mesh = *draw.mesh;
+    u32 face = triangle.faceIndex;
+
+    UberFragmentShaderIn in = {.position = triangle.position,
+                               .invW = triangle.invW,
+                               .varyings = {&bins->varyings[triangle.vertices[0]],
+                                            &bins->varyings[triangle.vertices[1]],
+                                            &bins->varyings[triangle.vertices[2]]},
+                               .tangent = glm::vec3(mesh.tangentX[face], mesh.tangentY[face],
+                                                    mesh.tangentZ[face]),
+                               .bitangent = glm::vec3(mesh.bitangentX[face],
+                                                      mesh.bitangentY[face],
+                                                      mesh.bitangentZ[face]),
+                               .buffer = app->image.buffer,
+                               .bufferWidth = app->image.width,
+                               .bufferHeight = app->image.height,
+
+                               .lightDir = app->lightDir,
+                               .diffuseTexture = app->diffuseTexture,
+                               .normalMapTexture = app->normalMapTexture,
+                               .specTexture = app->specTexture,
+                               .glowTexture = app->glowTexture,
+                               .textureFilter = app->textureFilter,
+
+                               .camPos = app->camera.pos,
+                               .uniforms = &draw.uniforms,
+                               .image = app->image,
+
+                               .tileMinX = tileMinX,
+                               .tileMinY = tileMinY,
+                               .tileMaxX = tileMaxX,
+                               .tileMaxY = tileMaxY,
+
+                               .rasterBackend = getSupportedRasterBackend(app->rasterBackend),
+                               .coarseDepth = &bins->coarseDepth,
+
+                               .gbuffer = gbuffer,
+                               .triangleId = triangleId};
+    return in;
+}
 
-    glm::mat4 rotation = glm::rotate(glm::radians(app->rotateY), glm::vec3(0, 1, 0));
-    glm::mat4 scale = glm::scale(glm::vec3(app->scale, app->scale, app->scale));
-    glm::mat4 translation = glm::translate(glm::vec3(app->translateX, app->translateY, 0));
+// Shading pass of the deferred mode, every visible pixel of the tile is shaded once.
+// Neighbouring pixels mostly share a triangle, so its constants are only rebuilt when
+// the triangle changes.
+void shadeGBufferTile(TileBins *bins, App *app, GBufferTile *gbuffer, int tileMinX,
+                      int tileMinY, int tileMaxX, int tileMaxY) {
+    u32 currentTriangle = GBUFFER_EMPTY;
+    UberFragmentShaderIn in;
+    UberTriangleConstants constants;
+
+    for (int y = tileMinY; y <= tileMaxY; y++) {
+        for (int x = tileMinX; x <= tileMaxX; x++) {
+            int texel = x - tileMinX + (y - tileMinY) * TILE_SIZE;
+            u32 triangleId = gbuffer->triangles[texel];
+            if (triangleId == GBUFFER_EMPTY) {
+                continue;
+            }
 
-    glm::mat4 parentWorldMatrix = getParentMatrix((Node *)shape);
-    glm::mat4 model = parentWorldMatrix * rotation;
+            if (triangleId != currentTriangle) {
+                in = getTileFragmentShaderIn(bins, app, triangleId, tileMinX, tileMinY, tileMaxX,
+                                             tileMaxY, gbuffer);
+                constants = setupUberTriangle(in);
+                currentTriangle = triangleId;
+            }
 
-    for (int i = 0; i < shape->faces.size(); i++) {
+            int coord = x + y * app->image.width;
+            glm::vec3 frag(x, y, app->image.zbuffer[coord]);
+            app->image.buffer[coord] =
+                shadeUberFragment(in, constants, frag, gbuffer->barycentrics[texel]);
+        }
+    }
+}
 
-        DefaultVertexShaderIn vertexIn = {.face = shape->faces[i],
-                                          .model = model,
-                                          .view = view,
-                                          .projection = projection,
-                                          .viewport = viewport};
+void runTileJob(void *userdata, int jobIndex) {
+    TileJob *job = (TileJob *)userdata;
+    TileBins *bins = job->bins;
+    App *app = job->app;
 
-        DefaultVertexShaderOut vertexOut = runDefaultVertexProgram(vertexIn);
+    u32 tileIndex = bins->activeTiles[jobIndex];
+    std::vector<u32> &tile = bins->tiles[tileIndex];
+
+    int tileMinX = (tileIndex % bins->tilesX) * TILE_SIZE;
+    int tileMinY = (tileIndex / bins->tilesX) * TILE_SIZE;
+    int tileMaxX = imin(tileMinX + TILE_SIZE - 1, bins->width - 1);
+    int tileMaxY = imin(tileMinY + TILE_SIZE - 1, bins->height - 1);
 
-        UberFragmentShaderIn in = {.position = vertexOut.position,
-                                   .face = shape->faces[i],
-                                   .buffer = app->image.buffer,
-                                   .bufferWidth = app->image.width,
-                                   .bufferHeight = app->image.height,
+    GBufferTile gbufferTile;
+    GBufferTile *gbuffer = NULL;
+    if (bins->deferred) {
+        gbuffer = &gbufferTile;
+        memset(gbuffer->triangles, 0xFF, sizeof(gbuffer->triangles));
+    }
+
+    for (int i = 0; i < tile.size(); i++) {
+        BinnedTriangle &triangle = bins->triangles[tile[i]];
+        DrawCall &draw = bins->draws[triangle.drawIndex];
+
+        glm::vec3 p0 = triangle.position[0];
+        glm::vec3 p1 = triangle.position[1];
+        glm::vec3 p2 = triangle.position[2];
 
-                                   .lightDir = app->lightDir,
-                                   .diffuseTexture = app->diffuseTexture,
-                                   .normalMapTexture = app->normalMapTexture,
-                                   .specTexture = app->specTexture,
-                                   .glowTexture = app->glowTexture,
+        PixelBounds bounds = getTrianglePixelBounds(p0, p1, p2);
+        int minX = imax(bounds.minX, tileMinX);
+        int maxX = imin(bounds.maxX, tileMaxX);
+        int minY = imax(bounds.minY, tileMinY);
+        int maxY = imin(bounds.maxY, tileMaxY);
+        float nearestZ = fmaxf(fmaxf(p0.z, p1.z), p2.z);
 
-                                   .camPos = app->camera.pos,
-                                   .model = model,
-                                   .view = view,
-                                   .projection = projection,
-                                   .viewport = viewport,
-                                   .image = app->image};
+        if (isOccludedCoarse(&bins->coarseDepth, minX, minY, maxX, maxY, nearestZ)) {
+            continue;
+        }
 
-        fragmentCallback(in);
+        UberFragmentShaderIn in = getTileFragmentShaderIn(bins, app, tile[i], tileMinX, tileMinY,
+                                                          tileMaxX, tileMaxY, gbuffer);
+
+        draw.fragmentCallback(in);
+    }
+
+    if (bins->deferred) {
+        shadeGBufferTile(bins, app, gbuffer, tileMinX, tileMinY, tileMaxX, tileMaxY);
+    }
+}
+
+void rasterizeTileBins(TileBins *bins, App *app) {
+    for (u32 i = 0; i < bins->tiles.size(); i++) {
+        if (!bins->tiles[i].empty()) {
+            bins->activeTiles.push_back(i);
+        }
+    }
+
+    TileJob job = {.bins = bins, .app = app};
+    runJobs(app->jobs, runTileJob, &job, bins->activeTiles.size());
+}
+
+// Coarsest LOD whose error, projected at the point of the bounds closest to the camera,
+// stays under app->lodPixelError. The shadow pass asks with the main camera too, so both
+// passes draw the same surface.
+Mesh *selectShapeMesh(Shape *shape, glm::mat4 model, App *app, glm::mat4 projection,
+                      glm::vec4 viewport) {
+    MeshResource *resource = shape->resource;
+    if (!app->useLODs || resource->lods.empty()) {
+        return &resource->mesh;
+    }
+
+    float scale = glm::max(glm::max(glm::length(glm::vec3(model[0])),
+                                    glm::length(glm::vec3(model[1]))),
+                           glm::length(glm::vec3(model[2])));
+    glm::vec3 center = glm::vec3(model * glm::vec4(resource->bounds.center, 1));
+    float distance = glm::length(center - app->camera.pos) - resource->bounds.radius * scale;
+    if (distance <= app->camera.zNear) {
+        return &resource->mesh;
+    }
+
+    // pixels one object space unit covers at that distance
+    float pixelsPerUnit = scale * fabsf(projection[1][1]) * viewport[3] * 0.5f / distance;
+
+    Mesh *mesh = &resource->mesh;
+    for (int i = 0; i < resource->lods.size(); i++) {
+        if (resource->lods[i].error * pixelsPerUnit > app->lodPixelError) {
+            break;
+        }
+        mesh = &resource->lods[i].mesh;
     }
+    return mesh;
 }
 
-void renderWorld_r(Node *root, App *app, glm::mat4 projection, glm::mat4 view, glm::vec4 viewport) {
-    std::vector<Node *> children = root->children;
-    for (int i = 0; i < children.size(); i++) {
-        Node *child = children[i];
-        if (!strcmp(child->type, "shape")) {
-            renderShape((Shape *)child, projection, view, viewport, app, runUberFragmentProgram);
+// Collects the shapes that are at least partly inside the frustum, in world order.
+void collectShapeInstances(World *world, App *app, glm::mat4 projection, glm::mat4 view,
+                           glm::vec4 viewport, std::vector<ShapeInstance> &instances) {
+    for (int i = 0; i < world->shapes.size(); i++) {
+        Shape *shape = &world->shapes[i];
+        glm::mat4 model = getShapeModelMatrix(shape, app);
+        bool visible = shape->resource &&
+                       !isOutsideFrustum(shape->resource->bounds, projection * view * model,
+                                         app->camera.zNear);
+        if (visible) {
+            ShapeInstance instance = {
+                .shape = shape,
+                .mesh = selectShapeMesh(shape, model, app, projection, viewport),
+                .model = model};
+            instances.push_back(instance);
         }
-        renderWorld_r(child, app, projection, view, viewport);
     }
 }
 
-void renderShadowMap_r(Node *root, App *app, glm::mat4 projection, glm::mat4 view,
-                       glm::vec4 viewport) {
-    std::vector<Node *> children = root->children;
-    for (int i = 0; i < children.size(); i++) {
-        Node *child = children[i];
-        if (!strcmp(child->type, "shape")) {
-            renderShape((Shape *)child, projection, view, viewport, app, runShadowFragmentProgram);
+typedef struct InstanceBatch {
+    int first;
+    int count;
+} InstanceBatch;
+
+// Draws the visible shapes grouped by the mesh they end up using, so copies of one asset
+// at the same LOD are set up in batches. A batch stops at about INSTANCE_BATCH_VERTICES,
+// past that the transformed vertices no longer stay in cache until triangle setup reads
+// them. Batches go in the order of their first shape, as close to world order as grouping
+// allows. Nothing here allocates once the arrays have grown to the scene.
+void renderWorld(World *world, App *app, glm::mat4 projection, glm::mat4 view,
+                 glm::vec4 viewport, FragmentCallback fragmentCallback, TileBins *bins) {
+    persist std::vector<ShapeInstance> instances;
+    persist std::vector<InstanceBatch> batches;
+    instances.clear();
+    batches.clear();
+    collectShapeInstances(world, app, projection, view, viewport, instances);
+
+    // shapes live in one array, so comparing their pointers is comparing world order
+    std::sort(instances.begin(), instances.end(),
+              [](const ShapeInstance &a, const ShapeInstance &b) {
+                  return a.mesh != b.mesh ? a.mesh < b.mesh : a.shape < b.shape;
+              });
+    for (int first = 0; first < instances.size();) {
+        Mesh *mesh = instances[first].mesh;
+        int maxCount = imax(INSTANCE_BATCH_VERTICES / imax(getMeshVertexCount(*mesh), 1), 1);
+        int last = first + 1;
+        while (last < instances.size() && instances[last].mesh == mesh &&
+               last - first < maxCount) {
+            last++;
         }
-        renderShadowMap_r(child, app, projection, view, viewport);
+        InstanceBatch batch = {.first = first, .count = last - first};
+        batches.push_back(batch);
+        first = last;
+    }
+    std::sort(batches.begin(), batches.end(),
+              [](const InstanceBatch &a, const InstanceBatch &b) {
+                  return instances[a.first].shape < instances[b.first].shape;
+              });
+
+    for (int i = 0; i < batches.size(); i++) {
+        ShapeInstance *batch = &instances[batches[i].first];
+        renderMeshInstances(batch->mesh, batch, batches[i].count, projection, view, viewport,
+                            app, fragmentCallback, bins);
     }
 }
 
@@ -392,24 +1108,33 @@ void trRender(App *app) {
     int width = image.width;
     int height = image.height;
 
-    float zNear = 0.01f;
-    float zFar = 1000.0f;
 
     app->lightDir.x = sin(3 * glfwGetTime());
     app->lightDir.y = 2 * cos(3 * glfwGetTime());
 
     glm::mat4 view = glm::lookAt(cam.pos, cam.target, cam.up);
-    glm::mat4 projection = glm::perspectiveLH(cam.fov, width / float(height), 0.01f, 1000.0f);
+    glm::mat4 projection = glm::perspectiveLH(cam.fov, width / float(height), cam.zNear, cam.zFar);
     glm::vec4 viewport(0.0f, 0.0f, width - 1, height - 1);
 
     if (app->showAxis) {
         drawAxis(view, projection, viewport, image);
     }
 
-    Node *root = app->world->worldRoot;
+    World *world = app->world;
+    updateWorldMatrices(world);
+
+    persist TileBins bins;
+
+    beginTileBins(&bins, width, height, image.shadowbuffer);
+    renderWorld(world, app, projection, getLightView(app->lightDir), viewport,
+                runShadowFragmentProgram, &bins);
+    rasterizeTileBins(&bins, app);
 
-    renderShadowMap_r(root, app, projection, getLightView(app->lightDir), viewport);
-    renderWorld_r(root, app, projection, view, viewport);
+    beginTileBins(&bins, width, height, image.zbuffer);
+    bins.deferred = app->deferredShading;
+    renderWorld(world, app, projection, view, viewport,
+                bins.deferred ? runGBufferFragmentProgram : runUberFragmentProgram, &bins);
+    rasterizeTileBins(&bins, app);
     /* screenSpaceAO(image); */
 }
 
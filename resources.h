@@ -0,0 +1,45 @@
+#ifndef __RESOURCES_H__
+#define __RESOURCES_H__
+
+#include "bvh.h"
+#include "mesh-cache.h"
+#include "obj-model.h"
+#include "simplify.h"
+#include "types.h"
+#include <string>
+#include <unordered_map>
+
+// Meshes loaded so far, by path. Placing the same OBJ again only costs a Shape pointing
+// at the resource that is already there.
+typedef struct MeshLibrary {
+    std::unordered_map<std::string, MeshResource *> resources;
+} MeshLibrary;
+
+// Loads the OBJ at path and builds its bounds, LODs and BVH, or takes all of it from the
+// mesh cache next to the OBJ when that is up to date. Returns NULL when the file can't be
+// read. Touches nothing shared, so loader threads can call it for different files at once.
+MeshResource *loadMeshResource(const char *path, JobPool *jobs) {
+    MeshResource *resource = new MeshResource();
+    if (!loadMeshCache(path, resource)) {
+        *resource = MeshResource();
+        if (!loadOBJ(path, resource->mesh, jobs)) {
+            delete resource;
+            return NULL;
+        }
+        resource->bounds = computeBounds(resource->mesh);
+        buildMeshLODs(resource->mesh, resource->lods);
+        buildBVH(resource->mesh, resource->bvh);
+        saveMeshCache(path, resource);
+    }
+    return resource;
+}
+
+void freeMeshLibrary(MeshLibrary *library) {
+    std::unordered_map<std::string, MeshResource *>::iterator it;
+    for (it = library->resources.begin(); it != library->resources.end(); it++) {
+        delete it->second;
+    }
+    library->resources.clear();
+}
+
+#endif // __RESOURCES_H__
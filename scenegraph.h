@@ -1,15 +1,93 @@
-
 #ifndef __SCENEGRAPH_H__
 #define __SCENEGRAPH_H__
 
 #include "types.h"
+#include <glm/gtx/transform.hpp>
+#include <vector>
+
+u32 addNode(World* world, u32 parent, NodeKind kind, char const* name, glm::mat4 local) {
+    u32 node = world->kinds.size();
+    world->kinds.push_back(kind);
+    world->names.push_back(name);
+    world->parents.push_back(parent);
+    world->firstChild.push_back(NO_NODE);
+    world->lastChild.push_back(NO_NODE);
+    world->nextSibling.push_back(NO_NODE);
+    world->shapeOf.push_back(NO_NODE);
+    world->local.push_back(local);
+    world->world.push_back(local);
+    world->dirty.push_back(true);
+    world->anyDirty = true;
+
+    // last among its siblings, so the tree lists nodes in the order they were added
+    if (parent != NO_NODE) {
+        u32 last = world->lastChild[parent];
+        if (last == NO_NODE) {
+            world->firstChild[parent] = node;
+        } else {
+            world->nextSibling[last] = node;
+        }
+        world->lastChild[parent] = node;
+    }
+    return node;
+}
+
+// Empties the world down to its root, WORLD_ROOT.
+void initWorld(World* world) {
+    world->kinds.clear();
+    world->names.clear();
+    world->parents.clear();
+    world->firstChild.clear();
+    world->lastChild.clear();
+    world->nextSibling.clear();
+    world->shapeOf.clear();
+    world->local.clear();
+    world->world.clear();
+    world->dirty.clear();
+    world->shapes.clear();
+    addNode(world, NO_NODE, NODE_ROOT, "world", glm::mat4(1));
+}
 
-void addNodes(Node* parent, Node* nodes, int count) {
-    for (int i = 0; i < count; i++) {
-        Node node = nodes[i];
-        node.parent = parent;
-        parent->children.push_back(&node);
+u32 addTransform(World* world, u32 parent, char const* name, glm::mat4 matrix) {
+    return addNode(world, parent, NODE_TRANSFORM, name, matrix);
+}
+
+// Places resource at the world matrix of parent.
+u32 addShape(World* world, u32 parent, char const* name, MeshResource* resource,
+             bool doubleSided) {
+    u32 node = addNode(world, parent, NODE_SHAPE, name, glm::mat4(1));
+    Shape shape = {.node = node, .resource = resource, .doubleSided = doubleSided};
+    world->shapeOf[node] = world->shapes.size();
+    world->shapes.push_back(shape);
+    return node;
+}
+
+// Changes the local matrix of a node, its subtree picks it up in the next update.
+void setTransformMatrix(World* world, u32 node, glm::mat4 matrix) {
+    world->local[node] = matrix;
+    world->dirty[node] = true;
+    world->anyDirty = true;
+}
+
+// Recomputes the world matrices of the dirty nodes and everything below them. Parents
+// come first, so a dirty flag reaches the whole subtree within the one pass.
+void updateWorldMatrices(World* world) {
+    if (!world->anyDirty) {
+        return;
+    }
+    u32 nodeCount = world->kinds.size();
+    for (u32 i = 0; i < nodeCount; i++) {
+        u32 parent = world->parents[i];
+        if (parent != NO_NODE && world->dirty[parent]) {
+            world->dirty[i] = true;
+        }
+        if (world->dirty[i]) {
+            world->world[i] =
+                parent == NO_NODE ? world->local[i] : world->world[parent] * world->local[i];
+        }
     }
+    world->dirty.assign(nodeCount, false);
+    world->anyDirty = false;
 }
 
 #endif // __SCENEGRAPH_H__
@@ -0,0 +1,353 @@
+#ifndef __SIMPLIFY_H__
+#define __SIMPLIFY_H__
+
+#include "obj-model.h"
+#include "types.h"
+#include <algorithm>
+#include <float.h>
+#include <glm/gtx/transform.hpp>
+#include <queue>
+#include <unordered_map>
+#include <vector>
+
+// Mesh simplification with quadric error metrics (Garland & Heckbert), used at load time
+// to build the LOD chain of a shape.
+//
+// Only half-edge collapses are done: a vertex is moved onto one of its neighbours, so
+// no new vertices are made and UVs and normals of the survivors stay what they were.
+// Collapses work on positions, vertices split along UV seams move together.
+
+#define LOD_MIN_TRIANGLES 256
+#define LOD_MAX_COUNT 8
+#define SIMPLIFY_BOUNDARY_WEIGHT 10.0f // keeps open borders from caving in
+
+// Sum of squared plane distances, stored as the upper half of a symmetric 4x4 matrix.
+// weight is the summed triangle area, errors are reported per unit of it.
+typedef struct Quadric {
+    double a2, ab, ac, ad;
+    double b2, bc, bd;
+    double c2, cd;
+    double d2;
+    double weight;
+} Quadric;
+
+inline void addPlane(Quadric &q, glm::vec3 normal, float d, float weight) {
+    double a = normal.x, b = normal.y, c = normal.z;
+    q.a2 += weight * a * a;
+    q.ab += weight * a * b;
+    q.ac += weight * a * c;
+    q.ad += weight * a * d;
+    q.b2 += weight * b * b;
+    q.bc += weight * b * c;
+    q.bd += weight * b * d;
+    q.c2 += weight * c * c;
+    q.cd += weight * c * d;
+    q.d2 += weight * double(d) * d;
+    q.weight += weight;
+}
+
+inline void addQuadric(Quadric &q, Quadric &other) {
+    q.a2 += other.a2;
+    q.ab += other.ab;
+    q.ac += other.ac;
+    q.ad += other.ad;
+    q.b2 += other.b2;
+    q.bc += other.bc;
+    q.bd += other.bd;
+    q.c2 += other.c2;
+    q.cd += other.cd;
+    q.d2 += other.d2;
+    q.weight += other.weight;
+}
+
+// Mean squared distance of p to the planes of the quadric.
+inline double getQuadricError(Quadric &q, glm::vec3 p) {
+    double x = p.x, y = p.y, z = p.z;
+    double error = q.a2 * x * x + 2 * q.ab * x * y + 2 * q.ac * x * z + 2 * q.ad * x +
+                   q.b2 * y * y + 2 * q.bc * y * z + 2 * q.bd * y + q.c2 * z * z +
+                   2 * q.cd * z + q.d2;
+    return q.weight > 0 ? fabs(error) / q.weight : 0;
+}
+
+typedef struct Collapse {
+    double cost;
+    u32 from;
+    u32 to;
+    u32 fromVersion;
+    u32 toVersion;
+} Collapse;
+
+struct CollapseIsCheaper {
+    bool operator()(const Collapse &a, const Collapse &b) const { return a.cost > b.cost; }
+};
+
+typedef struct Simplifier {
+    std::vector<glm::vec3> positions;
+    std::vector<Quadric> quadrics;
+    std::vector<std::vector<u32>> vertexTriangles;
+    std::vector<u32> version;
+    std::vector<bool> alive;
+
+    std::vector<u32> triangles; // three position indices each
+    std::vector<bool> removed;
+
+    std::priority_queue<Collapse, std::vector<Collapse>, CollapseIsCheaper> queue;
+} Simplifier;
+
+inline void pushCollapse(Simplifier &s, u32 from, u32 to) {
+    Quadric q = s.quadrics[from];
+    addQuadric(q, s.quadrics[to]);
+    Collapse collapse = {getQuadricError(q, s.positions[to]), from, to, s.version[from],
+                         s.version[to]};
+    s.queue.push(collapse);
+}
+
+inline void pushVertexCollapses(Simplifier &s, u32 vertex) {
+    for (int i = 0; i < s.vertexTriangles[vertex].size(); i++) {
+        u32 t = s.vertexTriangles[vertex][i];
+        if (s.removed[t]) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            u32 other = s.triangles[t * 3 + k];
+            if (other != vertex) {
+                pushCollapse(s, vertex, other);
+                pushCollapse(s, other, vertex);
+            }
+        }
+    }
+}
+
+// True when moving from onto to turns one of the triangles around from upside down.
+bool collapseFlipsTriangle(Simplifier &s, u32 from, u32 to) {
+    for (int i = 0; i < s.vertexTriangles[from].size(); i++) {
+        u32 t = s.vertexTriangles[from][i];
+        u32 *corners = &s.triangles[t * 3];
+        if (s.removed[t] || corners[0] == to || corners[1] == to || corners[2] == to) {
+            continue;
+        }
+
+        glm::vec3 p[3];
+        glm::vec3 moved[3];
+        for (int k = 0; k < 3; k++) {
+            p[k] = s.positions[corners[k]];
+            moved[k] = corners[k] == from ? s.positions[to] : p[k];
+        }
+        glm::vec3 before = glm::cross(p[1] - p[0], p[2] - p[0]);
+        glm::vec3 after = glm::cross(moved[1] - moved[0], moved[2] - moved[0]);
+        if (glm::dot(before, after) <= 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Vertex of the candidates whose UV is closest to the given one.
+u32 findClosestUV(Mesh &mesh, std::vector<u32> &candidates, float u, float v) {
+    u32 best = candidates[0];
+    float bestDistance = FLT_MAX;
+    for (int i = 0; i < candidates.size(); i++) {
+        float du = mesh.u[candidates[i]] - u;
+        float dv = mesh.v[candidates[i]] - v;
+        if (du * du + dv * dv < bestDistance) {
+            bestDistance = du * du + dv * dv;
+            best = candidates[i];
+        }
+    }
+    return best;
+}
+
+// Collapses the cheapest edges until the mesh is down to targetTriangles or nothing can
+// be collapsed anymore. Returns the largest error accepted, as a distance in object
+// units.
+float simplifyMesh(Mesh &mesh, u32 targetTriangles, Mesh &out) {
+    Simplifier s;
+    u32 vertexCount = getMeshVertexCount(mesh);
+    u32 triangleCount = getMeshTriangleCount(mesh);
+
+    // collapses work on positions, vertices that only differ in UV or normal are welded
+    std::vector<u32> positionOf;
+    u32 positionCount = weldPositions(mesh, positionOf);
+    s.positions.resize(positionCount);
+    std::vector<std::vector<u32>> verticesAt(positionCount);
+    for (u32 i = 0; i < vertexCount; i++) {
+        s.positions[positionOf[i]] = getMeshPosition(mesh, i);
+        verticesAt[positionOf[i]].push_back(i);
+    }
+
+    s.quadrics.resize(positionCount, Quadric{});
+    s.vertexTriangles.resize(positionCount);
+    s.version.resize(positionCount, 0);
+    s.alive.resize(positionCount, true);
+    s.triangles.resize(triangleCount * 3);
+    s.removed.resize(triangleCount, false);
+
+    std::unordered_map<u64, u32> edgeUses;
+    u32 liveTriangles = 0;
+    for (u32 t = 0; t < triangleCount; t++) {
+        u32 *corners = &s.triangles[t * 3];
+        for (int k = 0; k < 3; k++) {
+            corners[k] = positionOf[mesh.indices[t * 3 + k]];
+        }
+        if (corners[0] == corners[1] || corners[1] == corners[2] || corners[2] == corners[0]) {
+            s.removed[t] = true;
+            continue;
+        }
+        liveTriangles++;
+
+        glm::vec3 p0 = s.positions[corners[0]];
+        glm::vec3 normal = glm::cross(s.positions[corners[1]] - p0, s.positions[corners[2]] - p0);
+        float length = glm::length(normal);
+        for (int k = 0; k < 3; k++) {
+            s.vertexTriangles[corners[k]].push_back(t);
+            if (length > 0) {
+                addPlane(s.quadrics[corners[k]], normal / length,
+                         -glm::dot(normal / length, p0), length * 0.5f);
+            }
+
+            u32 a = std::min(corners[k], corners[(k + 1) % 3]);
+            u32 b = std::max(corners[k], corners[(k + 1) % 3]);
+            edgeUses[(u64(a) << 32) | b]++;
+        }
+    }
+
+    // edges used by a single triangle get a plane standing on them, across the surface
+    for (u32 t = 0; t < triangleCount; t++) {
+        if (s.removed[t]) {
+            continue;
+        }
+        u32 *corners = &s.triangles[t * 3];
+        glm::vec3 p0 = s.positions[corners[0]];
+        glm::vec3 normal = glm::cross(s.positions[corners[1]] - p0, s.positions[corners[2]] - p0);
+        for (int k = 0; k < 3; k++) {
+            u32 a = corners[k];
+            u32 b = corners[(k + 1) % 3];
+            if (edgeUses[(u64(std::min(a, b)) << 32) | std::max(a, b)] != 1) {
+                continue;
+            }
+            glm::vec3 edge = s.positions[b] - s.positions[a];
+            glm::vec3 side = glm::cross(edge, normal);
+            float length = glm::length(side);
+            if (length > 0) {
+                side /= length;
+                float weight = glm::dot(edge, edge) * SIMPLIFY_BOUNDARY_WEIGHT;
+                float d = -glm::dot(side, s.positions[a]);
+                addPlane(s.quadrics[a], side, d, weight);
+                addPlane(s.quadrics[b], side, d, weight);
+            }
+        }
+    }
+
+    for (u32 t = 0; t < triangleCount; t++) {
+        if (s.removed[t]) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            pushCollapse(s, s.triangles[t * 3 + k], s.triangles[t * 3 + (k + 1) % 3]);
+            pushCollapse(s, s.triangles[t * 3 + (k + 1) % 3], s.triangles[t * 3 + k]);
+        }
+    }
+
+    double maxCost = 0;
+    while (liveTriangles > targetTriangles && !s.queue.empty()) {
+        Collapse collapse = s.queue.top();
+        s.queue.pop();
+
+        u32 from = collapse.from;
+        u32 to = collapse.to;
+        // anything queued before one of the two vertices changed is out of date
+        if (!s.alive[from] || !s.alive[to] || collapse.fromVersion != s.version[from] ||
+            collapse.toVersion != s.version[to]) {
+            continue;
+        }
+        if (collapseFlipsTriangle(s, from, to)) {
+            continue;
+        }
+
+        for (int i = 0; i < s.vertexTriangles[from].size(); i++) {
+            u32 t = s.vertexTriangles[from][i];
+            u32 *corners = &s.triangles[t * 3];
+            if (s.removed[t]) {
+                continue;
+            }
+            if (corners[0] == to || corners[1] == to || corners[2] == to) {
+                s.removed[t] = true;
+                liveTriangles--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (corners[k] == from) {
+                    corners[k] = to;
+                }
+            }
+            s.vertexTriangles[to].push_back(t);
+        }
+
+        addQuadric(s.quadrics[to], s.quadrics[from]);
+        s.alive[from] = false;
+        s.version[to]++;
+        maxCost = std::max(maxCost, collapse.cost);
+
+        pushVertexCollapses(s, to);
+    }
+
+    // Corners that moved take the vertex at their new position with the closest UV,
+    // the rest keep their own. Only vertices still in use are copied over.
+    out = Mesh();
+    std::vector<u32> remap(vertexCount, OBJ_NO_INDEX);
+    for (u32 t = 0; t < triangleCount; t++) {
+        if (s.removed[t]) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            u32 vertex = mesh.indices[t * 3 + k];
+            u32 position = s.triangles[t * 3 + k];
+            if (positionOf[vertex] != position) {
+                vertex = findClosestUV(mesh, verticesAt[position], mesh.u[vertex], mesh.v[vertex]);
+            }
+
+            if (remap[vertex] == OBJ_NO_INDEX) {
+                remap[vertex] = getMeshVertexCount(out);
+                out.positionX.push_back(mesh.positionX[vertex]);
+                out.positionY.push_back(mesh.positionY[vertex]);
+                out.positionZ.push_back(mesh.positionZ[vertex]);
+                out.normalX.push_back(mesh.normalX[vertex]);
+                out.normalY.push_back(mesh.normalY[vertex]);
+                out.normalZ.push_back(mesh.normalZ[vertex]);
+                out.u.push_back(mesh.u[vertex]);
+                out.v.push_back(mesh.v[vertex]);
+            }
+            out.indices.push_back(remap[vertex]);
+        }
+    }
+    optimizeMesh(out);
+    calcTangentSpace(out);
+
+    return sqrt(maxCost);
+}
+
+// Builds coarser and coarser versions of the mesh, each one about half of the one
+// before, until they get small or stop shrinking. Every level starts from the previous
+// one, so errors are summed up along the chain.
+void buildMeshLODs(Mesh &mesh, std::vector<MeshLOD> &lods) {
+    lods.clear();
+    while (lods.size() < LOD_MAX_COUNT) {
+        Mesh &source = lods.empty() ? mesh : lods.back().mesh;
+        u32 triangleCount = getMeshTriangleCount(source);
+        if (triangleCount <= LOD_MIN_TRIANGLES) {
+            break;
+        }
+
+        MeshLOD lod;
+        lod.error = simplifyMesh(source, triangleCount / 2, lod.mesh);
+        if (getMeshTriangleCount(lod.mesh) > triangleCount * 3 / 4) {
+            break;
+        }
+        if (!lods.empty()) {
+            lod.error += lods.back().error;
+        }
+        lods.push_back(lod);
+    }
+}
+
+#endif // __SIMPLIFY_H__
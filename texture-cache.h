@@ -0,0 +1,121 @@
+#ifndef __TEXTURE_CACHE_H__
+#define __TEXTURE_CACHE_H__
+
+#include "image.h"
+#include "mesh-cache.h"
+#include "types.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Decoded texels of a PNG and its mip chain, written next to it as <png>.texcache so
+// later runs skip the inflate and the downsampling. The file is mapped and the texels
+// used right where they are, nothing is copied. Tied to the source file the same way as
+// the mesh cache.
+
+#define TEXTURE_CACHE_MAGIC 0x43545254 // "TRTC"
+// bump whenever the format or what is stored for a texture changes
+#define TEXTURE_CACHE_VERSION 3
+
+typedef struct TextureCacheHeader {
+    u32 magic;
+    u32 version;
+    u64 sourceSize;
+    u64 sourceTime;
+    u32 width;
+    u32 height;
+    u32 levelCount;
+    u32 padding[3]; // texels start 16 byte aligned
+} TextureCacheHeader;
+
+inline std::string getTextureCachePath(const char *pngPath) {
+    return std::string(pngPath) + ".texcache";
+}
+
+bool getTextureCacheHeader(const char *path, TextureCacheHeader *header) {
+    struct stat sourceInfo;
+    if (stat(path, &sourceInfo) < 0) {
+        return false;
+    }
+    memset(header, 0, sizeof(*header));
+    header->magic = TEXTURE_CACHE_MAGIC;
+    header->version = TEXTURE_CACHE_VERSION;
+    header->sourceSize = sourceInfo.st_size;
+    header->sourceTime = sourceInfo.st_mtime;
+    return true;
+}
+
+// Maps the cache of the PNG at path and points texture at its texels. mapping and
+// mappingSize are what has to go to munmap once the texture isn't used anymore. False
+// when there is no cache or it doesn't match, nothing stays mapped then.
+bool loadTextureCache(const char *path, Png *texture, void **mapping, size_t *mappingSize) {
+    TextureCacheHeader expected;
+    if (!getTextureCacheHeader(path, &expected)) {
+        return false;
+    }
+
+    std::string cachePath = getTextureCachePath(path);
+    int file = open(cachePath.c_str(), O_RDONLY);
+    if (file < 0) {
+        return false;
+    }
+    struct stat fileInfo;
+    size_t size = fstat(file, &fileInfo) < 0 ? 0 : fileInfo.st_size;
+    void *mapped = size < sizeof(TextureCacheHeader)
+                       ? MAP_FAILED
+                       : mmap(NULL, size, PROT_READ, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    TextureCacheHeader header;
+    memcpy(&header, mapped, sizeof(header));
+    expected.width = header.width;
+    expected.height = header.height;
+    expected.levelCount = getMipLevelCount(header.width, header.height);
+    if (memcmp(&header, &expected, sizeof(header)) || !header.width || !header.height ||
+        size != sizeof(header) + getMipLevelOffset(header.width, header.height,
+                                                   header.levelCount)) {
+        munmap(mapped, size);
+        return false;
+    }
+
+    texture->buffer = (unsigned char *)mapped + sizeof(header);
+    texture->width = header.width;
+    texture->height = header.height;
+    texture->levelCount = header.levelCount;
+    *mapping = mapped;
+    *mappingSize = size;
+    return true;
+}
+
+// Writes the cache of the PNG at path.
+void saveTextureCache(const char *path, Png texture) {
+    TextureCacheHeader header;
+    if (!getTextureCacheHeader(path, &header)) {
+        return;
+    }
+    header.width = texture.width;
+    header.height = texture.height;
+    header.levelCount = texture.levelCount;
+
+    std::string cachePath = getTextureCachePath(path);
+    std::string tempPath;
+    FILE *file = openCacheTempFile(cachePath, &tempPath);
+    if (!file) {
+        return;
+    }
+
+    fwrite(&header, sizeof(header), 1, file);
+    fwrite(texture.buffer, 1, getMipLevelOffset(texture.width, texture.height, texture.levelCount),
+           file);
+
+    finishCacheTempFile(file, tempPath, cachePath);
+}
+
+#endif // __TEXTURE_CACHE_H__
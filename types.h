@@ -11,14 +11,22 @@ typedef uint64_t u64;
 typedef uint32_t u32;
 typedef uint16_t u16;
 typedef uint8_t u8;
+typedef int64_t s64;
+typedef int32_t s32;
 
 enum RenderMode { TRIANGLES = 0, POINTS = 1, NORMALS = 2, ZBUFFER = 3, SHADOWBUFFER = 4};
 
+enum RasterBackend { RASTER_SCALAR = 0, RASTER_SSE = 1, RASTER_AVX2 = 2 };
+
+enum TextureFilter { TEXTURE_NEAREST = 0, TEXTURE_BILINEAR = 1, TEXTURE_TRILINEAR = 2 };
+
 typedef struct Camera {
     glm::vec3 pos;
     glm::vec3 target;
     glm::vec3 up;
     float fov;
+    float zNear;
+    float zFar;
 
     float yaw;
     float pitch;
@@ -36,44 +44,127 @@ typedef struct Image {
     u32 height;
 } Image;
 
-typedef struct {
-    glm::vec3 verts[3];
-    glm::vec3 normals[3];
-    glm::vec3 uvs[3];
-    glm::vec3 tangent;
-    glm::vec3 bitangent;
-    glm::vec3 faceNormal;
-} Face;
+// Object space bounding volumes, filled in once the mesh is loaded.
+typedef struct Bounds {
+    glm::vec3 min;
+    glm::vec3 max;
+    glm::vec3 center;
+    float radius;
+} Bounds;
+
+// Cluster of neighbouring triangles, a range of the mesh's triangle list, with bounds to
+// cull it as a whole. Built by buildMeshlets.
+typedef struct Meshlet {
+    u32 firstTriangle;
+    u32 triangleCount;
+    glm::vec3 center;
+    float radius;
+    glm::vec3 coneAxis; // average face normal
+    float coneCutoff;   // sine of the half angle of the normal cone, MESHLET_NO_CONE if too wide
+} Meshlet;
+
+// Indexed triangle list, one vertex per unique v/vt/vn triple of the OBJ so shared
+// vertices are only transformed once. Every attribute component lives in its own
+// contiguous stream, a pass over the mesh only pulls in the streams it reads.
+typedef struct Mesh {
+    std::vector<float> positionX;
+    std::vector<float> positionY;
+    std::vector<float> positionZ;
+    std::vector<float> normalX;
+    std::vector<float> normalY;
+    std::vector<float> normalZ;
+    std::vector<float> u;
+    std::vector<float> v;
+
+    std::vector<u32> indices; // three per triangle
+    std::vector<Meshlet> meshlets;
+
+    // tangent space of every triangle, for normal mapping
+    std::vector<float> tangentX;
+    std::vector<float> tangentY;
+    std::vector<float> tangentZ;
+    std::vector<float> bitangentX;
+    std::vector<float> bitangentY;
+    std::vector<float> bitangentZ;
+} Mesh;
+
+// Simplified version of a mesh. error is roughly how far its surface strays from the
+// full mesh, in object units.
+typedef struct MeshLOD {
+    Mesh mesh;
+    float error;
+} MeshLOD;
+
+// Node of a flattened BVH. The two children of an inner node sit next to each other
+// starting at leftFirst, a leaf covers count entries of BVH::triangles from leftFirst.
+typedef struct BVHNode {
+    glm::vec3 min;
+    u32 leftFirst;
+    glm::vec3 max;
+    u32 count; // 0 for inner nodes
+} BVHNode;
+
+// Bounding volume hierarchy over the triangles of a mesh, built by buildBVH.
+typedef struct BVH {
+    std::vector<BVHNode> nodes;     // root first
+    std::vector<u32> triangles;     // mesh triangle indices, grouped by leaf
+    std::vector<glm::vec3> corners; // three per entry of triangles, so leaves are contiguous
+} BVH;
+
+inline u32 getMeshVertexCount(Mesh &mesh) { return mesh.positionX.size(); }
+inline u32 getMeshTriangleCount(Mesh &mesh) { return mesh.indices.size() / 3; }
 
+inline glm::vec3 getMeshPosition(Mesh &mesh, u32 i) {
+    return glm::vec3(mesh.positionX[i], mesh.positionY[i], mesh.positionZ[i]);
+}
+
+// RGBA8 texels, the mip levels follow level 0 in the same buffer
 typedef struct Png {
     unsigned char *buffer;
     unsigned width;
     unsigned height;
+    unsigned levelCount;
 } Png;
 
-typedef struct Node {
-    struct Node* parent;
-    struct std::vector<Node*> children;
-    char const* name;
-    char const* type;
-} Node;
+enum NodeKind { NODE_ROOT, NODE_TRANSFORM, NODE_SHAPE };
 
-typedef struct World {
-    Node* worldRoot;
-} World;
+#define NO_NODE 0xFFFFFFFF
+#define WORLD_ROOT 0
 
-typedef struct Transform {
-    Node node;
-    glm::mat4 matrix;
-} Transform;
+// A loaded mesh with everything derived from it at load time. Shared by all the shapes
+// that place it, see loadMeshResource.
+typedef struct MeshResource {
+    Mesh mesh;
+    std::vector<MeshLOD> lods; // coarser and coarser, see buildMeshLODs
+    BVH bvh;                   // over mesh, for ray and box queries
+    Bounds bounds;
+} MeshResource;
 
+// One placement of a mesh resource, at the world matrix of its node.
 typedef struct Shape {
-    Node node;
-
-    std::vector<Face> faces;
-    std::vector<glm::vec3> vertices;
-    std::vector<glm::vec3> uvs;
-    std::vector<glm::vec3> normals;
+    u32 node;
+    MeshResource *resource;
+    bool doubleSided; // skips back-face culling
 } Shape;
 
+// Scene graph as flat arrays indexed by node handle. Nodes are only ever appended under
+// an existing parent, so parents come before their children and one pass in index order
+// has every parent's world matrix ready before its children need it.
+typedef struct World {
+    std::vector<NodeKind> kinds;
+    std::vector<char const*> names;
+    std::vector<u32> parents; // NO_NODE for the root
+    std::vector<u32> firstChild;
+    std::vector<u32> lastChild; // where the next child is linked in
+    std::vector<u32> nextSibling;
+    std::vector<u32> shapeOf; // into shapes for NODE_SHAPE, NO_NODE otherwise
+
+    std::vector<glm::mat4> local;
+    std::vector<glm::mat4> world;
+    std::vector<bool> dirty; // local changed, the world matrix of the subtree is stale
+    bool anyDirty;
+
+    std::vector<Shape> shapes; // what the renderer walks, in the order they were added
+} World;
+
 #endif // __TYPES_H__
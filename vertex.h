@@ -0,0 +1,199 @@
+#ifndef __VERTEX_H__
+#define __VERTEX_H__
+
+#include "clip.h"
+#include "raster.h"
+#include "types.h"
+#include <glm/gtx/transform.hpp>
+
+// Batched form of the position math of the default vertex program, used by the SSE and
+// AVX2 back ends. Positions come in as the x/y/z streams of the mesh and leave as
+// streams again, one array per component, VERTEX_BATCH_SIZE vertices per call.
+//
+// Every matrix product is summed as (m0 x + m1 y) + (m2 z + m3), the order glm uses,
+// and divides stay divides, so a batch matches the scalar path bit for bit.
+
+#define VERTEX_BATCH_SIZE 8
+
+typedef struct VertexTransform {
+    glm::mat4 clipMatrix;  // model view projection
+    glm::mat4 lightMatrix; // same for the shadow map
+    glm::vec4 viewport;
+    float zNear;
+} VertexTransform;
+
+typedef struct VertexBatch {
+    float clipX[VERTEX_BATCH_SIZE];
+    float clipY[VERTEX_BATCH_SIZE];
+    float clipZ[VERTEX_BATCH_SIZE];
+    float clipW[VERTEX_BATCH_SIZE];
+
+    float lightX[VERTEX_BATCH_SIZE];
+    float lightY[VERTEX_BATCH_SIZE];
+    float lightZ[VERTEX_BATCH_SIZE];
+    float lightW[VERTEX_BATCH_SIZE];
+
+    // clipToViewport of the clip position
+    float screenX[VERTEX_BATCH_SIZE];
+    float screenY[VERTEX_BATCH_SIZE];
+    float screenZ[VERTEX_BATCH_SIZE];
+    float invW[VERTEX_BATCH_SIZE];
+
+    u32 clipCode[VERTEX_BATCH_SIZE];
+} VertexBatch;
+
+#ifdef RASTER_X86
+
+// One row of m times (x, y, z, 1) for four points.
+inline __m128 transformRowSSE(glm::mat4 &m, int row, __m128 x, __m128 y, __m128 z) {
+    __m128 xy = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0][row]), x),
+                           _mm_mul_ps(_mm_set1_ps(m[1][row]), y));
+    __m128 zw = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2][row]), z), _mm_set1_ps(m[3][row]));
+    return _mm_add_ps(xy, zw);
+}
+
+// Fills lanes first..first+3 of the batch.
+void transformVerticesSSE(VertexTransform &transform, const float *positionX,
+                          const float *positionY, const float *positionZ, VertexBatch *out,
+                          int first) {
+    __m128 x = _mm_loadu_ps(positionX + first);
+    __m128 y = _mm_loadu_ps(positionY + first);
+    __m128 z = _mm_loadu_ps(positionZ + first);
+
+    __m128 clipX = transformRowSSE(transform.clipMatrix, 0, x, y, z);
+    __m128 clipY = transformRowSSE(transform.clipMatrix, 1, x, y, z);
+    __m128 clipZ = transformRowSSE(transform.clipMatrix, 2, x, y, z);
+    __m128 clipW = transformRowSSE(transform.clipMatrix, 3, x, y, z);
+    _mm_storeu_ps(out->clipX + first, clipX);
+    _mm_storeu_ps(out->clipY + first, clipY);
+    _mm_storeu_ps(out->clipZ + first, clipZ);
+    _mm_storeu_ps(out->clipW + first, clipW);
+
+    _mm_storeu_ps(out->lightX + first, transformRowSSE(transform.lightMatrix, 0, x, y, z));
+    _mm_storeu_ps(out->lightY + first, transformRowSSE(transform.lightMatrix, 1, x, y, z));
+    _mm_storeu_ps(out->lightZ + first, transformRowSSE(transform.lightMatrix, 2, x, y, z));
+    _mm_storeu_ps(out->lightW + first, transformRowSSE(transform.lightMatrix, 3, x, y, z));
+
+    __m128 half = _mm_set1_ps(0.5f);
+    __m128 ndcX = _mm_add_ps(_mm_mul_ps(_mm_div_ps(clipX, clipW), half), half);
+    __m128 ndcY = _mm_add_ps(_mm_mul_ps(_mm_div_ps(clipY, clipW), half), half);
+    __m128 ndcZ = _mm_add_ps(_mm_mul_ps(_mm_div_ps(clipZ, clipW), half), half);
+    glm::vec4 &viewport = transform.viewport;
+    _mm_storeu_ps(out->screenX + first, _mm_add_ps(_mm_mul_ps(ndcX, _mm_set1_ps(viewport[2])),
+                                                   _mm_set1_ps(viewport[0])));
+    _mm_storeu_ps(out->screenY + first, _mm_add_ps(_mm_mul_ps(ndcY, _mm_set1_ps(viewport[3])),
+                                                   _mm_set1_ps(viewport[1])));
+    _mm_storeu_ps(out->screenZ + first, ndcZ);
+    _mm_storeu_ps(out->invW + first, _mm_div_ps(_mm_set1_ps(1.0f), clipW));
+
+    // getClipCode, one plane at a time
+    __m128 zero = _mm_setzero_ps();
+    __m128 guard = _mm_set1_ps(GUARD_BAND);
+    __m128 w = _mm_xor_ps(clipW, _mm_set1_ps(-0.0f));
+    __m128 guardW = _mm_mul_ps(guard, w);
+    __m128 nearPlane = _mm_cmplt_ps(_mm_sub_ps(w, _mm_set1_ps(transform.zNear)), zero);
+    __m128 left = _mm_cmplt_ps(_mm_add_ps(guardW, clipX), zero);
+    __m128 right = _mm_cmplt_ps(_mm_sub_ps(guardW, clipX), zero);
+    __m128 bottom = _mm_cmplt_ps(_mm_add_ps(guardW, clipY), zero);
+    __m128 top = _mm_cmplt_ps(_mm_sub_ps(guardW, clipY), zero);
+
+    __m128i code = _mm_and_si128(_mm_castps_si128(nearPlane), _mm_set1_epi32(CLIP_NEAR));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(left), _mm_set1_epi32(CLIP_LEFT)));
+    code =
+        _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(right), _mm_set1_epi32(CLIP_RIGHT)));
+    code = _mm_or_si128(code,
+                        _mm_and_si128(_mm_castps_si128(bottom), _mm_set1_epi32(CLIP_BOTTOM)));
+    code = _mm_or_si128(code, _mm_and_si128(_mm_castps_si128(top), _mm_set1_epi32(CLIP_TOP)));
+    _mm_storeu_si128((__m128i *)(out->clipCode + first), code);
+}
+
+__attribute__((target("avx2"))) inline __m256 transformRowAVX2(glm::mat4 &m, int row, __m256 x,
+                                                                __m256 y, __m256 z) {
+    __m256 xy = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[0][row]), x),
+                              _mm256_mul_ps(_mm256_set1_ps(m[1][row]), y));
+    __m256 zw =
+        _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(m[2][row]), z), _mm256_set1_ps(m[3][row]));
+    return _mm256_add_ps(xy, zw);
+}
+
+// Same as the SSE version, all eight lanes at once.
+__attribute__((target("avx2"))) void
+transformVerticesAVX2(VertexTransform &transform, const float *positionX, const float *positionY,
+                      const float *positionZ, VertexBatch *out) {
+    __m256 x = _mm256_loadu_ps(positionX);
+    __m256 y = _mm256_loadu_ps(positionY);
+    __m256 z = _mm256_loadu_ps(positionZ);
+
+    __m256 clipX = transformRowAVX2(transform.clipMatrix, 0, x, y, z);
+    __m256 clipY = transformRowAVX2(transform.clipMatrix, 1, x, y, z);
+    __m256 clipZ = transformRowAVX2(transform.clipMatrix, 2, x, y, z);
+    __m256 clipW = transformRowAVX2(transform.clipMatrix, 3, x, y, z);
+    _mm256_storeu_ps(out->clipX, clipX);
+    _mm256_storeu_ps(out->clipY, clipY);
+    _mm256_storeu_ps(out->clipZ, clipZ);
+    _mm256_storeu_ps(out->clipW, clipW);
+
+    _mm256_storeu_ps(out->lightX, transformRowAVX2(transform.lightMatrix, 0, x, y, z));
+    _mm256_storeu_ps(out->lightY, transformRowAVX2(transform.lightMatrix, 1, x, y, z));
+    _mm256_storeu_ps(out->lightZ, transformRowAVX2(transform.lightMatrix, 2, x, y, z));
+    _mm256_storeu_ps(out->lightW, transformRowAVX2(transform.lightMatrix, 3, x, y, z));
+
+    __m256 half = _mm256_set1_ps(0.5f);
+    __m256 ndcX = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(clipX, clipW), half), half);
+    __m256 ndcY = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(clipY, clipW), half), half);
+    __m256 ndcZ = _mm256_add_ps(_mm256_mul_ps(_mm256_div_ps(clipZ, clipW), half), half);
+    glm::vec4 &viewport = transform.viewport;
+    _mm256_storeu_ps(out->screenX, _mm256_add_ps(_mm256_mul_ps(ndcX, _mm256_set1_ps(viewport[2])),
+                                                 _mm256_set1_ps(viewport[0])));
+    _mm256_storeu_ps(out->screenY, _mm256_add_ps(_mm256_mul_ps(ndcY, _mm256_set1_ps(viewport[3])),
+                                                 _mm256_set1_ps(viewport[1])));
+    _mm256_storeu_ps(out->screenZ, ndcZ);
+    _mm256_storeu_ps(out->invW, _mm256_div_ps(_mm256_set1_ps(1.0f), clipW));
+
+    __m256 zero = _mm256_setzero_ps();
+    __m256 guard = _mm256_set1_ps(GUARD_BAND);
+    __m256 w = _mm256_xor_ps(clipW, _mm256_set1_ps(-0.0f));
+    __m256 guardW = _mm256_mul_ps(guard, w);
+    __m256 nearPlane = _mm256_cmp_ps(_mm256_sub_ps(w, _mm256_set1_ps(transform.zNear)), zero,
+                                _CMP_LT_OQ);
+    __m256 left = _mm256_cmp_ps(_mm256_add_ps(guardW, clipX), zero, _CMP_LT_OQ);
+    __m256 right = _mm256_cmp_ps(_mm256_sub_ps(guardW, clipX), zero, _CMP_LT_OQ);
+    __m256 bottom = _mm256_cmp_ps(_mm256_add_ps(guardW, clipY), zero, _CMP_LT_OQ);
+    __m256 top = _mm256_cmp_ps(_mm256_sub_ps(guardW, clipY), zero, _CMP_LT_OQ);
+
+    __m256i code = _mm256_and_si256(_mm256_castps_si256(nearPlane), _mm256_set1_epi32(CLIP_NEAR));
+    code = _mm256_or_si256(
+        code, _mm256_and_si256(_mm256_castps_si256(left), _mm256_set1_epi32(CLIP_LEFT)));
+    code = _mm256_or_si256(
+        code, _mm256_and_si256(_mm256_castps_si256(right), _mm256_set1_epi32(CLIP_RIGHT)));
+    code = _mm256_or_si256(
+        code, _mm256_and_si256(_mm256_castps_si256(bottom), _mm256_set1_epi32(CLIP_BOTTOM)));
+    code = _mm256_or_si256(
+        code, _mm256_and_si256(_mm256_castps_si256(top), _mm256_set1_epi32(CLIP_TOP)));
+    _mm256_storeu_si256((__m256i *)out->clipCode, code);
+}
+
+#endif // RASTER_X86
+
+// Transforms VERTEX_BATCH_SIZE vertices starting at the given stream pointers. Returns
+// false for the scalar back end, the caller then runs the vertex program per vertex.
+inline bool transformVertices(RasterBackend backend, VertexTransform &transform,
+                              const float *positionX, const float *positionY,
+                              const float *positionZ, VertexBatch *out) {
+#ifdef RASTER_X86
+    switch (backend) {
+    case RASTER_AVX2:
+        transformVerticesAVX2(transform, positionX, positionY, positionZ, out);
+        return true;
+    case RASTER_SSE:
+        transformVerticesSSE(transform, positionX, positionY, positionZ, out, 0);
+        transformVerticesSSE(transform, positionX, positionY, positionZ, out, 4);
+        return true;
+    default:
+        break;
+    }
+#endif
+    return false;
+}
+
+#endif // __VERTEX_H__